@@ -0,0 +1,17 @@
+#include <cstddef>
+#include <cstdint>
+
+#include "memory/alloc.h"
+
+/*
+ * The Rust runtime crate implements GlobalAlloc on top of these functions,
+ * see kernel/bootstrap/src/lib.rs for the declarations on the Rust side.
+ */
+extern "C" uint8_t* bootstrap_allocate_aligned(size_t size, size_t align) {
+    return reinterpret_cast<uint8_t*>(memory::AllocateAligned(size, align));
+}
+
+extern "C" void bootstrap_free_aligned(
+        uint8_t* ptr, size_t size, size_t align) {
+    memory::FreeAligned(ptr, size, align);
+}
@@ -0,0 +1,83 @@
+#include <cstdint>
+
+#include "common/logging.h"
+#include "memory/space.h"
+
+
+// The registers saved by exception_entry in interrupts.S.
+struct ExceptionFrame {
+    uint64_t x[19];
+    uint64_t fp;
+    uint64_t lr;
+    uint64_t sp;
+    uint64_t esr;
+    uint64_t far;
+    uint64_t elr;
+    uint64_t spsr;
+};
+
+namespace {
+
+// AArch64 System Register Descriptions, D13.2.37 ESR_EL2, Exception Syndrome
+// Register (EL2) for the encoding of the exception class and the syndrome of
+// the data aborts.
+constexpr uint64_t kEcShift = 26;
+constexpr uint64_t kEcMask = 0x3f;
+// Data abort taken without a change in the exception level.
+constexpr uint64_t kEcDataAbort = 0x25;
+
+constexpr uint64_t kIssWnR = 1ull << 6;
+constexpr uint64_t kIssCM = 1ull << 8;
+constexpr uint64_t kIssFnV = 1ull << 10;
+// The fault status code without the level of the translation table the
+// fault happened at.
+constexpr uint64_t kDfscMask = 0x3c;
+constexpr uint64_t kDfscTranslation = 0x04;
+constexpr uint64_t kDfscPermission = 0x0c;
+
+[[ noreturn ]] void Panic() {
+    while (1) {
+        asm volatile("":::"memory");
+    }
+}
+
+bool HandleDataAbort(const ExceptionFrame& frame) {
+    // FAR_EL2 doesn't hold the faulting address.
+    if ((frame.esr & kIssFnV) != 0) {
+        return false;
+    }
+
+    const uint64_t status = frame.esr & kDfscMask;
+    if (status != kDfscTranslation && status != kDfscPermission) {
+        return false;
+    }
+
+    memory::AddressSpace* aspace = memory::KernelAddressSpace();
+    if (aspace == nullptr) {
+        return false;
+    }
+
+    // Cache maintenance instructions report WnR set, but they don't need
+    // write access.
+    const bool write =
+        (frame.esr & kIssWnR) != 0 && (frame.esr & kIssCM) == 0;
+    return aspace->Fault(frame.far, write);
+}
+
+}  // namespace
+
+// Called from exception_entry. When it returns the faulting instruction is
+// executed again, so a resolved fault is transparent to the code.
+extern "C" void exception(ExceptionFrame* frame) {
+    const uint64_t ec = (frame->esr >> kEcShift) & kEcMask;
+
+    if (ec == kEcDataAbort && HandleDataAbort(*frame)) {
+        return;
+    }
+
+    common::Log() << "Unhandled exception: ESR "
+          << reinterpret_cast<const void*>(frame->esr)
+          << ", FAR " << reinterpret_cast<const void*>(frame->far)
+          << ", ELR " << reinterpret_cast<const void*>(frame->elr) << "\n";
+    Panic();
+}
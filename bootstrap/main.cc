@@ -1,6 +1,7 @@
 #include <cstdint>
 #include <cstring>
 
+#include <memory>
 #include <new>
 #include <utility>
 
@@ -8,9 +9,15 @@
 #include "common/string_view.h"
 #include "common/vector.h"
 #include "common/allocator.h"
+#include "common/arena.h"
 #include "fdt/blob.h"
+#include "memory/alloc.h"
 #include "memory/cache.h"
+#include "memory/early.h"
 #include "memory/memory.h"
+#include "memory/profile.h"
+#include "memory/space.h"
+#include "memory/vmalloc.h"
 #include "bootstrap/memory.h"
 #include "bootstrap/pl011.h"
 #include "common/logging.h"
@@ -38,14 +45,18 @@ bool LookupDTB(
     return false;
 }
 
+// The modules are reserved in one MemoryBatch, so the bootloader can't pass
+// more than 64 of them (see MemoryBatch::kMaxUpdates).
 bool ReserveMemory(
         const struct Data *data, size_t size, memory::MemoryMap* mmap) {
+    memory::MemoryBatch batch(mmap);
+
     for (size_t i = 0; i < size; ++i) {
-        if (!mmap->Reserve(data[i].begin, data[i].end)) {
+        if (!batch.Reserve(data[i].begin, data[i].end)) {
             return false;
         }
     }
-    return true;
+    return batch.Flush();
 }
 
 void PrintMMap(const memory::MemoryMap& mmap) {
@@ -108,19 +119,15 @@ struct Pointer : public common::ListNode<Pointer> {
 };
 
 void CacheTest() {
-    memory::Cache cache(sizeof(Pointer), alignof(Pointer));
+    memory::TypedCache<Pointer> cache("pointer-test");
     common::IntrusiveList<Pointer> ptrs;
     size_t allocated = 0;
 
     while (1) {
-        void* p = cache.Allocate();
-        if (p == nullptr) {
+        Pointer* ptr = cache.New();
+        if (ptr == nullptr) {
             break;
         }
-        memset(p, 0, sizeof(Pointer));
-        Pointer* ptr = reinterpret_cast<Pointer*>(p);
-        ::new(ptr) Pointer();
-        ptr->ptr = p;
         ptrs.LinkAt(ptrs.Begin(), ptr);
         ++allocated;
     }
@@ -132,8 +139,7 @@ void CacheTest() {
     size_t freed = 0;
 
     while (!ptrs.Empty()) {
-        Pointer* ptr = ptrs.PopFront();
-        cache.Free(ptr->ptr);
+        cache.Delete(ptrs.PopFront());
         freed++;
     }
 
@@ -149,6 +155,413 @@ void CacheTest() {
           << " bytes after reclaim\n";
 }
 
+void CacheBulkTest() {
+    constexpr size_t kBurst = 64;
+    memory::Cache cache(
+        "pointer-bulk-test", sizeof(Pointer), alignof(Pointer));
+    common::IntrusiveList<Pointer> ptrs;
+    size_t allocated = 0;
+
+    while (1) {
+        void* burst[kBurst];
+        const size_t count = cache.AllocateBulk(burst, kBurst);
+        for (size_t i = 0; i < count; ++i) {
+            Pointer* ptr = reinterpret_cast<Pointer*>(burst[i]);
+            ::new(ptr) Pointer();
+            ptr->ptr = burst[i];
+            ptrs.LinkAt(ptrs.Begin(), ptr);
+        }
+        allocated += count;
+        if (count != kBurst) {
+            break;
+        }
+    }
+
+    common::Log() << "Allocated " << allocated
+          << " items of size " << sizeof(Pointer)
+          << " bytes in bursts of " << kBurst << " items\n";
+    size_t freed = 0;
+
+    while (!ptrs.Empty()) {
+        void* burst[kBurst];
+        size_t count = 0;
+        while (count < kBurst && !ptrs.Empty()) {
+            burst[count++] = ptrs.PopFront()->ptr;
+        }
+        freed += cache.FreeBulk(burst, count);
+    }
+
+    common::Log() << "Freed " << freed
+          << " items of size " << sizeof(Pointer)
+          << " bytes in bursts of " << kBurst << " items\n";
+
+    cache.Reclaim();
+
+    common::Log() << "Available " << memory::AvailablePhysical()
+          << " bytes after reclaim\n";
+}
+
+void CacheChurnTest() {
+    constexpr size_t kObjects = 8192;
+    constexpr size_t kSteps = 2000000;
+    constexpr size_t kPhase = 100000;
+    constexpr size_t kReport = kPhase / 10;
+    static void* objects[kObjects];
+    memory::Cache cache(
+        "pointer-churn-test", sizeof(Pointer), alignof(Pointer));
+    uint64_t state = 1;
+    size_t live = 0;
+
+    for (size_t step = 1; step <= kSteps; ++step) {
+        // Knuth's MMIX LCG, we just need some cheap pseudo-randomness here.
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        const size_t random = state >> 33;
+
+        // The number of live objects drifts towards the target that changes
+        // every phase, so the cache is constantly refilled and drained while
+        // objects are freed in a random order.
+        const size_t target =
+            (step / kPhase) % 2 == 0 ? kObjects : kObjects / 8;
+        const bool grow = live < target
+            ? random % 4 != 0
+            : random % 4 == 0;
+
+        if (grow && live < kObjects) {
+            void* ptr = cache.Allocate();
+            if (ptr == nullptr) {
+                break;
+            }
+            objects[live++] = ptr;
+        } else if (live > 0) {
+            const size_t pos = (random >> 2) % live;
+            cache.Free(objects[pos]);
+            objects[pos] = objects[--live];
+        }
+
+        if (step % kReport == 0) {
+            cache.Reclaim();
+            common::Log() << "Step " << step
+                  << ": allocated " << cache.Allocated()
+                  << " bytes, occupied " << cache.Occupied() << " bytes\n";
+        }
+    }
+
+    while (live > 0) {
+        cache.Free(objects[--live]);
+    }
+    cache.Reclaim();
+}
+
+struct Constructed {
+    static size_t constructed;
+    static size_t destroyed;
+
+    common::IntrusiveList<Pointer> items;
+    uint64_t magic = kMagic;
+
+    static constexpr uint64_t kMagic = 0x5ca1ab1e;
+
+    static void Construct(void* ptr) {
+        ::new(ptr) Constructed();
+        ++constructed;
+    }
+
+    static void Destroy(void* ptr) {
+        reinterpret_cast<Constructed*>(ptr)->~Constructed();
+        ++destroyed;
+    }
+};
+
+size_t Constructed::constructed = 0;
+size_t Constructed::destroyed = 0;
+
+void CacheConstructorTest() {
+    constexpr size_t kObjects = 1024;
+    constexpr size_t kRounds = 16;
+    static Constructed* objects[kObjects];
+    memory::Cache cache(
+        "constructed-test", sizeof(Constructed), alignof(Constructed),
+        &Constructed::Construct, &Constructed::Destroy);
+    size_t allocated = 0;
+    size_t broken = 0;
+
+    for (size_t round = 0; round < kRounds; ++round) {
+        for (size_t i = 0; i < kObjects; ++i) {
+            objects[i] = reinterpret_cast<Constructed*>(cache.Allocate());
+            if (objects[i] == nullptr) {
+                Panic();
+            }
+            if (objects[i]->magic != Constructed::kMagic ||
+                    !objects[i]->items.Empty()) {
+                ++broken;
+            }
+            ++allocated;
+        }
+
+        for (size_t i = 0; i < kObjects; ++i) {
+            cache.Free(objects[i]);
+        }
+    }
+
+    cache.Reclaim();
+
+    common::Log() << "Allocated " << allocated << " constructed objects, "
+          << Constructed::constructed << " constructor calls, "
+          << Constructed::destroyed << " destructor calls, "
+          << broken << " objects in a wrong state\n";
+}
+
+// Only static caches become merge targets, the test destroys one anyway to
+// check that the objects of the cache merged into it survive it.
+void CacheMergeTest() {
+    constexpr size_t kObjects = 1024;
+    static uint64_t* objects[kObjects];
+    memory::Cache cache("merge-test", 40, 8);
+    size_t broken = 0;
+
+    {
+        memory::Cache first("merge-test-first", 40, 8, memory::kCacheStatic);
+        void* ptr = first.Allocate();
+        if (ptr == nullptr) {
+            Panic();
+        }
+
+        for (size_t i = 0; i < kObjects; ++i) {
+            objects[i] = reinterpret_cast<uint64_t*>(cache.Allocate());
+            if (objects[i] == nullptr) {
+                Panic();
+            }
+            objects[i][1] = i;
+        }
+        first.Free(ptr);
+    }
+
+    const size_t occupied = cache.Occupied();
+    for (size_t i = 0; i < kObjects; ++i) {
+        if (objects[i][1] != i) {
+            ++broken;
+        }
+        if (!cache.Free(objects[i])) {
+            ++broken;
+        }
+    }
+    cache.Reclaim();
+
+    common::Log() << "Freed " << kObjects << " objects of a merged cache "
+          << "after its merge target was destroyed, " << occupied
+          << " bytes occupied before the frees, " << cache.Occupied()
+          << " after, " << broken << " objects broken\n";
+}
+
+void SmallAllocationTest() {
+    constexpr size_t kObjects = 4096;
+    constexpr size_t kMaxSize = 256;
+    static uint8_t* objects[kObjects];
+    const size_t before = memory::AvailablePhysical();
+    size_t broken = 0;
+
+    for (size_t i = 0; i < kObjects; ++i) {
+        const size_t size = i % kMaxSize + 1;
+        objects[i] = reinterpret_cast<uint8_t*>(memory::Allocate(size));
+        if (objects[i] == nullptr) {
+            Panic();
+        }
+        memset(objects[i], static_cast<int>(i & 0xff), size);
+    }
+
+    const size_t used = before - memory::AvailablePhysical();
+
+    for (size_t i = 0; i < kObjects; ++i) {
+        const size_t size = i % kMaxSize + 1;
+        for (size_t j = 0; j < size; ++j) {
+            if (objects[i][j] != static_cast<uint8_t>(i & 0xff)) {
+                ++broken;
+                break;
+            }
+        }
+        memory::Free(objects[i]);
+    }
+
+    common::Log() << "Allocated " << kObjects << " objects of 1 to "
+          << kMaxSize << " bytes using " << used << " bytes, "
+          << broken << " objects corrupted\n";
+}
+
+void AlignedAllocationTest() {
+    constexpr size_t kMaxAlignment = static_cast<size_t>(2) << 20;
+    constexpr size_t kSizes[] = { 1, 24, 100, 4000, 5000, 70000 };
+    const size_t before = memory::AvailablePhysical();
+    size_t allocated = 0;
+    size_t misaligned = 0;
+
+    for (size_t align = 8; align <= kMaxAlignment; align *= 2) {
+        for (size_t size : kSizes) {
+            void* ptr = memory::AllocateAligned(size, align);
+            if (ptr == nullptr) {
+                Panic();
+            }
+            if (reinterpret_cast<uintptr_t>(ptr) % align != 0) {
+                ++misaligned;
+            }
+            memset(ptr, 0, size);
+            memory::FreeAligned(ptr, size, align);
+            ++allocated;
+        }
+    }
+
+    common::Log() << "Allocated " << allocated << " blocks aligned up to "
+          << kMaxAlignment << " bytes, " << misaligned << " misaligned, "
+          << before - memory::AvailablePhysical() << " bytes held by caches\n";
+}
+
+uint64_t Counter() {
+    uint64_t counter;
+    asm volatile("isb; mrs %0, CNTVCT_EL0" : "=r"(counter));
+    return counter;
+}
+
+uint64_t CounterFrequency() {
+    uint64_t frequency;
+    asm volatile("mrs %0, CNTFRQ_EL0" : "=r"(frequency));
+    return frequency;
+}
+
+void HotAllocationTest() {
+    constexpr size_t kRounds = 1000000;
+    constexpr size_t kSizes[] = { 16, 64, 256 };
+
+    for (size_t size : kSizes) {
+        const uint64_t start = Counter();
+        for (size_t i = 0; i < kRounds; ++i) {
+            void* ptr = memory::Allocate(size);
+            if (ptr == nullptr) {
+                Panic();
+            }
+            memory::Free(ptr, size);
+        }
+        const uint64_t ticks = Counter() - start;
+        const uint64_t ns = ticks * 1000000000 / CounterFrequency();
+
+        common::Log() << "Allocated and freed " << size << " bytes "
+              << kRounds << " times in " << ns / kRounds
+              << " ns per pair\n";
+    }
+
+    memory::FlushCpuCache();
+}
+
+// The check after the call keeps the compiler from turning it into a tail
+// call, so the return address of memory::Allocate is inside the function.
+[[ gnu::noinline ]] void* ProfiledAllocation(size_t size) {
+    void* ptr = memory::Allocate(size);
+    if (ptr == nullptr) {
+        Panic();
+    }
+    return ptr;
+}
+
+void HeapProfileTest() {
+    constexpr size_t kObjects = 4096;
+    constexpr size_t kSize = 64;
+    constexpr size_t kPeriod = 16 * 1024;
+    // ProfiledAllocation is a lot shorter than that and nothing else
+    // allocates while the profiler is running.
+    constexpr uintptr_t kFunctionSize = 256;
+    static void* objects[kObjects];
+
+    const uintptr_t from = reinterpret_cast<uintptr_t>(&ProfiledAllocation);
+    const void* site_begin = reinterpret_cast<const void*>(from);
+    const void* site_end = reinterpret_cast<const void*>(from + kFunctionSize);
+    const void* all_begin = reinterpret_cast<const void*>(0);
+    const void* all_end = reinterpret_cast<const void*>(~uintptr_t(0));
+
+    memory::StartHeapProfile(kPeriod);
+    for (size_t i = 0; i < kObjects; ++i) {
+        objects[i] = ProfiledAllocation(kSize);
+    }
+    memory::DumpHeapProfile();
+
+    // Every period bytes allocated produce one sample of period bytes, so
+    // the estimate can be off by a period at each end.
+    const size_t live = memory::HeapProfileBytes(site_begin, site_end);
+    if (live + 2 * kPeriod < kObjects * kSize
+            || live > kObjects * kSize + 2 * kPeriod) {
+        Panic();
+    }
+
+    for (size_t i = 0; i < kObjects; ++i) {
+        memory::Free(objects[i]);
+    }
+    memory::StopHeapProfile();
+    memory::DumpHeapProfile();
+
+    const size_t left = memory::HeapProfileBytes(all_begin, all_end);
+    if (left != 0) {
+        Panic();
+    }
+
+    common::Log() << "Heap profile reported " << live << " bytes at "
+          << site_begin << " for " << kObjects * kSize
+          << " bytes allocated, " << left << " bytes after freeing\n";
+}
+
+struct Shape {
+    static size_t destroyed;
+
+    virtual ~Shape() { ++destroyed; }
+    virtual size_t Area() const = 0;
+};
+
+size_t Shape::destroyed = 0;
+
+struct Square : public Shape {
+    size_t side;
+
+    explicit Square(size_t side) : side(side) {}
+    size_t Area() const override { return side * side; }
+};
+
+struct alignas(64) AlignedSquare : public Square {
+    char line[64];
+
+    explicit AlignedSquare(size_t side) : Square(side) {}
+};
+
+void NewDeleteTest() {
+    constexpr size_t kObjects = 1024;
+    static Shape* shapes[kObjects];
+    const size_t before = memory::AvailablePhysical();
+    size_t misaligned = 0;
+    size_t area = 0;
+
+    Shape::destroyed = 0;
+    for (size_t i = 0; i < kObjects; ++i) {
+        if (i % 2 == 0) {
+            shapes[i] = new Square(i);
+            continue;
+        }
+
+        AlignedSquare* square = new AlignedSquare(i);
+        if (reinterpret_cast<uintptr_t>(square) % alignof(AlignedSquare)) {
+            ++misaligned;
+        }
+        shapes[i] = square;
+    }
+
+    for (size_t i = 0; i < kObjects; ++i) {
+        area += shapes[i]->Area();
+        delete shapes[i];
+    }
+
+    char* buffer = new char[3 * memory::kPageSize];
+    delete[] buffer;
+
+    common::Log() << "Created " << kObjects << " objects with new, total area "
+          << area << ", " << Shape::destroyed << " destroyed, "
+          << misaligned << " misaligned, "
+          << before - memory::AvailablePhysical() << " bytes held by caches\n";
+}
+
 struct LargeItem {
     char buf[128];
 
@@ -163,14 +576,21 @@ void VectorTest() {
 
     {
         common::Vector<LargeItem, common::PhysicalAllocator<LargeItem>> v;
+        const LargeItem* data = nullptr;
+        size_t moves = 0;
 
         while (v.PushBack(LargeItem())) {
+            if (v.Data() != data) {
+                data = v.Data();
+                ++moves;
+            }
             if ((v.Size() % 100000) == 0) {
                 common::Log() << "Current vector size " << v.Size() << "\n";
             }
         }
 
-        common::Log() << "Vector size " << v.Size() << " entries currently\n";
+        common::Log() << "Vector size " << v.Size() << " entries currently, "
+              << "storage moved " << moves << " times\n";
         common::Log() << "Available " << memory::AvailablePhysical()
               << " bytes after filling vector\n";
     }
@@ -179,12 +599,608 @@ void VectorTest() {
           << " bytes after deleting vector\n";
 }
 
+void ArenaTest() {
+    constexpr size_t kItems = 100000;
+    constexpr size_t kObjects = 10000;
+    const size_t before = memory::AvailablePhysical();
+    common::Arena arena;
+
+    // An allocation larger than a chunk gets a chunk of its own and the
+    // following allocations continue in the current chunk.
+    uint8_t* first = static_cast<uint8_t*>(arena.Allocate(64, 8));
+    void* large = arena.Allocate(2 * common::Arena::kDefaultChunkSize, 8);
+    uint8_t* next = static_cast<uint8_t*>(arena.Allocate(64, 8));
+    if (first == nullptr || large == nullptr || next != first + 64) {
+        Panic();
+    }
+    arena.Reset();
+
+    for (size_t round = 0; round < 2; ++round) {
+        common::Vector<uint64_t, common::ArenaAllocator<uint64_t>> v{
+            common::ArenaAllocator<uint64_t>(&arena)};
+        size_t moves = 0;
+        const uint64_t* data = nullptr;
+
+        for (size_t i = 0; i < kItems; ++i) {
+            if (!v.PushBack(i)) {
+                Panic();
+            }
+            if (v.Data() != data) {
+                data = v.Data();
+                ++moves;
+            }
+        }
+
+        for (size_t i = 0; i < kObjects; ++i) {
+            if (arena.Allocate(i % 100 + 1, 8) == nullptr) {
+                Panic();
+            }
+        }
+
+        common::Log() << "Arena allocated " << arena.Allocated()
+              << " bytes in " << arena.Occupied() << " bytes of chunks, "
+              << "vector storage moved " << moves << " times\n";
+        arena.Reset();
+    }
+
+    common::Log() << "Arena holds " << arena.Occupied() << " bytes after reset, "
+          << before - memory::AvailablePhysical() << " bytes in use\n";
+}
+
+void SortTest() {
+    constexpr size_t kItems = 100000;
+    static uint64_t items[kItems];
+    uint64_t state = 1;
+    size_t misses = 0;
+
+    for (size_t i = 0; i < kItems; ++i) {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        items[i] = state >> 16;
+    }
+
+    const uint64_t start = Counter();
+    std::sort(items, items + kItems);
+    const uint64_t sorted = Counter();
+    for (size_t i = 0; i < kItems; ++i) {
+        if (!std::binary_search(items, items + kItems, items[i])) {
+            ++misses;
+        }
+    }
+    const uint64_t searched = Counter();
+    const uint64_t frequency = CounterFrequency();
+
+    common::Log() << "Sorted " << kItems << " items in "
+          << (sorted - start) * 1000000 / frequency << " us, "
+          << (std::is_sorted(items, items + kItems) ? "sorted" : "NOT sorted")
+          << ", searched all in " << (searched - sorted) * 1000000 / frequency
+          << " us, " << misses << " misses\n";
+}
+
+void MemoryMapTest() {
+    constexpr size_t kRanges = 4096;
+    constexpr uintptr_t kBase = static_cast<uintptr_t>(1) << 40;
+    constexpr uintptr_t kSize = memory::kPageSize;
+    constexpr uintptr_t kStep = 2 * kSize;
+    static memory::MemoryMap map;
+    size_t failures = 0;
+
+    const uint64_t start = Counter();
+    for (size_t i = 0; i < kRanges; ++i) {
+        const uintptr_t begin = kBase + i * kStep;
+        if (!map.Register(begin, begin + kSize, memory::MemoryStatus::FREE)) {
+            ++failures;
+        }
+    }
+    const uint64_t registered = Counter();
+    const size_t ranges = map.Size();
+
+    // Multiplying by an odd number permutes the indices, so the ranges are
+    // split in a scattered order rather than sequentially.
+    for (size_t i = 0; i < kRanges; ++i) {
+        const size_t index = (i * 2654435761ull) % kRanges;
+        const uintptr_t begin = kBase + index * kStep + kSize / 4;
+        if (!map.Reserve(begin, begin + kSize / 2)) {
+            ++failures;
+        }
+    }
+    const uint64_t reserved = Counter();
+    const size_t split = map.Size();
+
+    for (size_t i = 0; i < kRanges; ++i) {
+        const size_t index = (i * 2654435761ull) % kRanges;
+        const uintptr_t begin = kBase + index * kStep + kSize / 4;
+        if (!map.Release(begin, begin + kSize / 2)) {
+            ++failures;
+        }
+    }
+    const uint64_t released = Counter();
+    const size_t merged = map.Size();
+
+    for (size_t i = 0; i < kRanges; ++i) {
+        uintptr_t addr;
+        if (!map.Allocate(kSize, kSize, &addr) || addr != kBase + i * kStep) {
+            ++failures;
+        }
+    }
+    const uint64_t allocated = Counter();
+    uintptr_t addr;
+    if (map.Allocate(1, 1, &addr)) {
+        ++failures;
+    }
+
+    const uint64_t frequency = CounterFrequency();
+    const auto per_op = [=](uint64_t from, uint64_t to) {
+        return (to - from) * 1000000000 / frequency / kRanges;
+    };
+
+    common::Log() << "Memory map with " << ranges << " ranges: register "
+          << per_op(start, registered) << " ns, reserve "
+          << per_op(registered, reserved) << " ns (" << split
+          << " ranges), release " << per_op(reserved, released) << " ns ("
+          << merged << " ranges), allocate " << per_op(released, allocated)
+          << " ns, " << failures << " failures\n";
+}
+
+void MemoryBatchTest() {
+    constexpr size_t kRegions = 1024;
+    constexpr size_t kReserved = 4096;
+    constexpr uintptr_t kBase = static_cast<uintptr_t>(1) << 40;
+    constexpr uintptr_t kRegion = 16 * memory::kPageSize;
+    static memory::MemoryUpdate updates[kRegions + kReserved];
+    static memory::MemoryMap one_by_one;
+    static memory::MemoryMap batched;
+    uint64_t state = 1;
+
+    for (size_t i = 0; i < kRegions; ++i) {
+        memory::MemoryUpdate& update = updates[i];
+        update.operation = memory::MemoryOperation::REGISTER;
+        update.status = memory::MemoryStatus::FREE;
+        update.begin = kBase + ((i * 2654435761ull) % kRegions) * 2 * kRegion;
+        update.end = update.begin + kRegion;
+    }
+
+    for (size_t i = kRegions; i < kRegions + kReserved; ++i) {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        const uintptr_t offset = (state >> 16) % (2 * kRegions * kRegion);
+
+        memory::MemoryUpdate& update = updates[i];
+        update.operation = memory::MemoryOperation::RESERVE;
+        update.status = memory::MemoryStatus::RESERVED;
+        update.begin = kBase + common::AlignDown(offset, memory::kPageSize);
+        update.end = update.begin + memory::kPageSize;
+    }
+
+    const uint64_t start = Counter();
+    bool ok = true;
+    for (size_t i = 0; i < kRegions + kReserved; ++i) {
+        const memory::MemoryUpdate& update = updates[i];
+        if (update.operation == memory::MemoryOperation::REGISTER) {
+            ok = ok && one_by_one.Register(
+                update.begin, update.end, update.status);
+        } else {
+            ok = ok && one_by_one.Reserve(update.begin, update.end);
+        }
+    }
+    const uint64_t sequential = Counter();
+    ok = ok && batched.ApplyBatch(updates, kRegions + kReserved);
+    const uint64_t batch = Counter();
+    const uint64_t frequency = CounterFrequency();
+
+    auto l = one_by_one.ConstBegin();
+    auto r = batched.ConstBegin();
+    for (; l != one_by_one.ConstEnd() && r != batched.ConstEnd(); ++l, ++r) {
+        if (l->begin != r->begin || l->end != r->end) {
+            break;
+        }
+        if (l->status != r->status) {
+            break;
+        }
+    }
+    const bool same = l == one_by_one.ConstEnd() && r == batched.ConstEnd();
+
+    common::Log() << "Memory map with " << batched.Size() << " ranges built in "
+          << (sequential - start) * 1000000 / frequency << " us one by one and "
+          << (batch - sequential) * 1000000 / frequency << " us in a batch, "
+          << (ok ? "" : "with failures, ")
+          << (same ? "same ranges" : "DIFFERENT ranges") << "\n";
+
+    // MemoryBatch stages the updates until Flush, so the reservation added
+    // first is still applied after the registration added last.
+    constexpr size_t kStaged = 32;
+    static memory::MemoryMap staged;
+    memory::MemoryBatch staging(&staged);
+    const uintptr_t last = kBase + (kStaged - 1) * 2 * kRegion;
+
+    ok = staging.Reserve(last, last + memory::kPageSize);
+    for (size_t i = 0; i < kStaged; ++i) {
+        const uintptr_t begin = kBase + i * 2 * kRegion;
+        ok = ok && staging.Register(
+            begin, begin + kRegion, memory::MemoryStatus::FREE);
+    }
+    ok = ok && staging.Flush();
+
+    auto reserved = staged.ConstBegin();
+    while (reserved != staged.ConstEnd() && reserved->begin != last) {
+        ++reserved;
+    }
+    if (!ok || reserved == staged.ConstEnd()
+            || reserved->status != memory::MemoryStatus::RESERVED) {
+        Panic();
+    }
+    common::Log() << "Staged " << kStaged + 1 << " updates in a batch, "
+          << staged.Size() << " ranges\n";
+
+    // The registration below the map is valid and comes first, but the
+    // second one conflicts with the reservation, so neither is applied.
+    const size_t ranges = staged.Size();
+    memory::MemoryBatch failing(&staged);
+    ok = failing.Register(kBase - kRegion, kBase, memory::MemoryStatus::FREE)
+        && failing.Register(
+            last, last + memory::kPageSize, memory::MemoryStatus::FREE)
+        && !failing.Flush();
+    if (!ok || staged.Size() != ranges
+            || staged.ConstBegin()->begin != kBase) {
+        Panic();
+    }
+}
+
+void EarlyAllocatorTest() {
+    using memory::Fit;
+    using memory::Placement;
+
+    constexpr uintptr_t kBase = static_cast<uintptr_t>(1) << 40;
+    constexpr uintptr_t kKiB = static_cast<uintptr_t>(1) << 10;
+    constexpr uintptr_t kMiB = static_cast<uintptr_t>(1) << 20;
+
+    // Free ranges: 1 MiB at the bottom, 64 KiB and 20 KiB holes in between
+    // and 60 MiB at the top.
+    static memory::MemoryMap map;
+    map.Register(kBase, kBase + 64 * kMiB, memory::MemoryStatus::FREE);
+    map.Reserve(kBase + 1 * kMiB, kBase + 2 * kMiB);
+    map.Reserve(kBase + 2 * kMiB + 64 * kKiB, kBase + 3 * kMiB);
+    map.Reserve(kBase + 3 * kMiB + 20 * kKiB, kBase + 4 * kMiB);
+    const size_t ranges = map.Size();
+
+    struct Case {
+        Placement placement;
+        Fit fit;
+        size_t size;
+        size_t alignment;
+        uintptr_t expected;
+    };
+
+    const Case cases[] = {
+        { Placement::BOTTOM_UP, Fit::FIRST, 16 * kKiB, 16 * kKiB, kBase },
+        { Placement::TOP_DOWN, Fit::FIRST, 16 * kKiB, 16 * kKiB,
+          kBase + 64 * kMiB - 16 * kKiB },
+        { Placement::BOTTOM_UP, Fit::BEST, 16 * kKiB, 16 * kKiB,
+          kBase + 3 * kMiB },
+        { Placement::TOP_DOWN, Fit::BEST, 16 * kKiB, 16 * kKiB,
+          kBase + 3 * kMiB },
+        { Placement::BOTTOM_UP, Fit::BEST, 32 * kKiB, 32 * kKiB,
+          kBase + 2 * kMiB },
+        { Placement::TOP_DOWN, Fit::BEST, 32 * kKiB, 32 * kKiB,
+          kBase + 2 * kMiB + 32 * kKiB },
+        { Placement::TOP_DOWN, Fit::BEST, 2 * kMiB, 2 * kMiB,
+          kBase + 62 * kMiB },
+    };
+    constexpr size_t kCases = sizeof(cases) / sizeof(cases[0]);
+
+    memory::EarlyAllocator early(&map);
+    size_t failures = 0;
+
+    for (size_t i = 0; i < kCases; ++i) {
+        const Case& c = cases[i];
+        uintptr_t addr;
+
+        early.SetPlacement(c.placement);
+        early.SetFit(c.fit);
+        if (!early.Allocate(c.size, c.alignment, &addr)) {
+            ++failures;
+            continue;
+        }
+        if (addr != c.expected) {
+            ++failures;
+        }
+        early.Free(addr, addr + c.size);
+    }
+
+    common::Log() << "Early allocator: " << kCases << " placements checked, "
+          << failures << " failures, " << map.Size() << " ranges after "
+          << "freeing (" << ranges << " before)\n";
+}
+
+void AddressSpaceTest() {
+    constexpr uintptr_t kMiB = static_cast<uintptr_t>(1) << 20;
+    constexpr uintptr_t kVirt = static_cast<uintptr_t>(1) << 40;
+    constexpr uintptr_t kPhys = static_cast<uintptr_t>(1) << 32;
+    constexpr uintptr_t kSize = 64 * kMiB;
+    constexpr uintptr_t kOffset = 123;
+
+    // The mapping crosses the boundary of the root table entries, so all
+    // the levels of the tables have to be split between two subtrees.
+    const memory::AddressRange range{kVirt - kSize / 2, kVirt + kSize / 2};
+    const memory::AddressRange overlap{kVirt, kVirt + memory::kPageSize};
+    memory::AddressSpace aspace;
+    size_t failures = 0;
+
+    if (!aspace.RegisterMapping(std::make_unique<memory::StaticMapping>(
+            range, kPhys, memory::kNormalMemory))) {
+        ++failures;
+    }
+    if (aspace.RegisterMapping(std::make_unique<memory::StaticMapping>(
+            overlap, kPhys, memory::kDeviceMemory))) {
+        ++failures;
+    }
+
+    const uint64_t start = Counter();
+    if (!aspace.Populate(range.from, range.to)) {
+        ++failures;
+    }
+    const uint64_t populated = Counter();
+
+    for (uintptr_t addr = range.from; addr < range.to;
+            addr += memory::kPageSize) {
+        const uintptr_t expected = kPhys + (addr - range.from) + kOffset;
+        uintptr_t phys;
+
+        if (!aspace.Translate(addr + kOffset, &phys) || phys != expected) {
+            ++failures;
+        }
+    }
+    const uint64_t translated = Counter();
+
+    memory::Mapping* mapping = aspace.FindMapping(kVirt);
+    if (mapping == nullptr) {
+        ++failures;
+    } else {
+        aspace.UnregisterMapping(mapping);
+    }
+    const uint64_t unmapped = Counter();
+
+    uintptr_t phys;
+    if (aspace.Translate(kVirt, &phys) || aspace.Populate(kVirt, kVirt + 1)) {
+        ++failures;
+    }
+
+    const uint64_t frequency = CounterFrequency();
+    common::Log() << "Address space: mapped " << kSize / memory::kPageSize
+          << " pages in " << (populated - start) * 1000000 / frequency
+          << " us, translated in "
+          << (translated - populated) * 1000000 / frequency
+          << " us, unmapped in "
+          << (unmapped - translated) * 1000000 / frequency
+          << " us, " << failures << " failures\n";
+}
+
+uint64_t WalkPages(uintptr_t base, size_t pages, size_t rounds) {
+    // The stride is odd, so with the power of two number of pages every page
+    // is visited once per round, but the neighbouring reads are far apart.
+    constexpr size_t kStride = 4099;
+    volatile uint64_t sum = 0;
+
+    const uint64_t start = Counter();
+    for (size_t i = 0; i < pages * rounds; ++i) {
+        const size_t page = (i * kStride) % pages;
+        sum = sum + *reinterpret_cast<const volatile uint64_t*>(
+            base + page * memory::kPageSize);
+    }
+    return Counter() - start;
+}
+
+// Reads a word from every page of a large buffer, once through the linear
+// map, that uses blocks, and once through an alias shifted by a page, that
+// can only use 4 KiB pages without the contiguous hint.
+void TlbTest(memory::AddressSpace* aspace) {
+    constexpr size_t kSize = 32 << 20;
+    constexpr size_t kPages = kSize / memory::kPageSize;
+    constexpr size_t kRounds = 16;
+    constexpr uintptr_t kAlias =
+        (static_cast<uintptr_t>(1) << 40) + memory::kPageSize;
+
+    auto buffer = memory::AllocatePhysical(kSize);
+    if (!buffer) {
+        common::Log() << "Not enough memory for the TLB test\n";
+        return;
+    }
+
+    const uintptr_t phys = buffer->FromAddress();
+    const memory::AddressRange range{kAlias, kAlias + kSize};
+    memset(reinterpret_cast<void*>(phys), 0, kSize);
+
+    if (!aspace->RegisterMapping(std::make_unique<memory::StaticMapping>(
+            range, phys, memory::kNormalMemory | memory::kExecuteNever))) {
+        common::Log() << "Failed to map the TLB test buffer\n";
+        memory::FreePhysical(*buffer);
+        return;
+    }
+
+    memory::Mapping* mapping = aspace->FindMapping(kAlias);
+    if (aspace->Populate(range.from, range.to)) {
+        const uint64_t blocks = WalkPages(phys, kPages, kRounds);
+        const uint64_t pages = WalkPages(kAlias, kPages, kRounds);
+        const uint64_t reads = kPages * kRounds;
+        const uint64_t frequency = CounterFrequency();
+
+        common::Log() << "TLB test: " << reads << " reads of " << kPages
+              << " pages took " << blocks * 1000000000 / frequency / reads
+              << " ns per read with blocks and "
+              << pages * 1000000000 / frequency / reads
+              << " ns per read with pages\n";
+    } else {
+        common::Log() << "Failed to populate the TLB test mapping\n";
+    }
+
+    const uint64_t start = Counter();
+    aspace->UnregisterMapping(mapping);
+    const uint64_t unmapped = Counter() - start;
+    memory::FreePhysical(*buffer);
+
+    common::Log() << "TLB test: unmapped " << kPages << " pages in "
+          << unmapped * 1000000 / CounterFrequency() << " us\n";
+}
+
+// Reserves a large anonymous mapping and touches a few pages of it, first
+// reading them, which should be served by the zero page, and then writing,
+// which should allocate only the pages that were written.
+void DemandPagingTest(memory::AddressSpace* aspace) {
+    constexpr uintptr_t kBase = static_cast<uintptr_t>(1) << 41;
+    constexpr size_t kSize = static_cast<size_t>(1) << 30;
+    constexpr size_t kTouched = 256;
+    constexpr size_t kStride = kSize / kTouched;
+
+    const size_t before = memory::AvailablePhysical();
+    const memory::AddressRange range{kBase, kBase + kSize};
+    if (!aspace->RegisterMapping(std::make_unique<memory::AnonymousMapping>(
+            range, memory::kNormalMemory | memory::kExecuteNever))) {
+        common::Log() << "Failed to register the demand paging mapping\n";
+        Panic();
+    }
+
+    size_t failures = 0;
+    for (size_t i = 0; i < kTouched; ++i) {
+        const volatile uint64_t* ptr =
+            reinterpret_cast<const volatile uint64_t*>(kBase + i * kStride);
+        if (*ptr != 0) {
+            ++failures;
+        }
+    }
+    const size_t after_reads = before - memory::AvailablePhysical();
+
+    for (size_t i = 0; i < kTouched; ++i) {
+        volatile uint64_t* ptr =
+            reinterpret_cast<volatile uint64_t*>(kBase + i * kStride);
+        *ptr = i + 1;
+    }
+    for (size_t i = 0; i < kTouched; ++i) {
+        const volatile uint64_t* ptr =
+            reinterpret_cast<const volatile uint64_t*>(kBase + i * kStride);
+        if (*ptr != i + 1) {
+            ++failures;
+        }
+    }
+    const size_t after_writes = before - memory::AvailablePhysical();
+
+    aspace->UnregisterMapping(aspace->FindMapping(kBase));
+    const size_t after_unmap = before - memory::AvailablePhysical();
+
+    common::Log() << "Demand paging test: " << kTouched << " reads of a "
+          << (kSize >> 20) << " MiB mapping used " << after_reads
+          << " bytes, writes used " << after_writes << " bytes, "
+          << after_unmap << " bytes after unmapping, "
+          << failures << " failures\n";
+}
+
+// Fills the buffer allocated with AllocateVirtual, checks the contents and
+// returns the number of physically contiguous parts the buffer consists of.
+size_t CheckVirtualBuffer(uint64_t* buffer, size_t size, size_t* failures) {
+    const size_t words = size / sizeof(uint64_t);
+    for (size_t i = 0; i < words; ++i) {
+        buffer[i] = i;
+    }
+    for (size_t i = 0; i < words; ++i) {
+        if (buffer[i] != i) {
+            ++*failures;
+        }
+    }
+    if (memory::VirtualSize(buffer) != size) {
+        ++*failures;
+    }
+
+    const uintptr_t from = reinterpret_cast<uintptr_t>(buffer);
+    memory::AddressSpace* aspace = memory::KernelAddressSpace();
+    uintptr_t next = 0;
+    size_t parts = 0;
+    for (uintptr_t addr = from; addr < from + size; addr += memory::kPageSize) {
+        uintptr_t phys;
+        if (!aspace->Translate(addr, &phys)) {
+            ++*failures;
+            continue;
+        }
+        if (phys != next) {
+            ++parts;
+        }
+        next = phys + memory::kPageSize;
+    }
+    return parts;
+}
+
+// Fragments the physical memory, so that no free block is larger than
+// kBlock, and then allocates a buffer much larger than that.
+void VirtualAllocatorTest() {
+    constexpr size_t kBlock = static_cast<size_t>(4) << 20;
+    constexpr size_t kSize = static_cast<size_t>(64) << 20;
+    const size_t before = memory::AvailablePhysical();
+    size_t failures = 0;
+
+    {
+        common::Vector<uintptr_t, common::PhysicalAllocator<uintptr_t>> blocks;
+        while (auto mem = memory::AllocatePhysical(kBlock)) {
+            if (!blocks.PushBack(mem->FromAddress())) {
+                memory::FreePhysical(*mem);
+                break;
+            }
+        }
+        for (size_t i = 0; i < blocks.Size(); i += 2) {
+            memory::FreePhysical(blocks[i]);
+        }
+
+        if (auto mem = memory::AllocatePhysical(kSize)) {
+            common::Log() << "Failed to fragment the memory\n";
+            memory::FreePhysical(*mem);
+        }
+
+        uint64_t* buffer =
+            static_cast<uint64_t*>(memory::AllocateVirtual(kSize));
+        if (buffer != nullptr) {
+            const size_t parts = CheckVirtualBuffer(buffer, kSize, &failures);
+            memory::FreeVirtual(buffer);
+            common::Log() << "Virtual allocator test: " << (kSize >> 20)
+                  << " MiB buffer consists of " << parts
+                  << " physically contiguous parts\n";
+        } else {
+            ++failures;
+        }
+
+        for (size_t i = 1; i < blocks.Size(); i += 2) {
+            memory::FreePhysical(blocks[i]);
+        }
+    }
+
+    common::Log() << "Virtual allocator test: " << failures << " failures, "
+          << before - memory::AvailablePhysical() << " bytes not freed\n";
+}
+
+// Runs the tests that touch the most memory and returns the time they took
+// in microseconds.
+uint64_t TimedTests() {
+    const uint64_t start = Counter();
+    AllocatorTest();
+    CacheTest();
+    VectorTest();
+    return (Counter() - start) * 1000000 / CounterFrequency();
+}
+
+constexpr uintptr_t kSerialBase = 0x9000000;
+
+bool MapSerial(memory::AddressSpace* aspace) {
+    const memory::AddressRange range{
+        kSerialBase, kSerialBase + memory::kPageSize};
+
+    if (!aspace->RegisterMapping(std::make_unique<memory::StaticMapping>(
+            range, kSerialBase,
+            memory::kDeviceMemory | memory::kExecuteNever))) {
+        return false;
+    }
+    return aspace->Populate(range.from, range.to);
+}
+
 void SetupLogger() {
     // For HiKey960 board that I have the following parameters were found to        // work fine:
     //
     // PL011::Serial(
     //     /* base_address = */0xfff32000, /* base_clock = */19200000);
-    static PL011 serial = PL011::Serial(0x9000000, 24000000);
+    static PL011 serial = PL011::Serial(kSerialBase, 24000000);
     static PL011OutputStream stream(&serial);
     common::RegisterLog(&stream); 
 }
@@ -232,20 +1248,24 @@ extern "C" void kernel(struct Data *data, size_t size) {
         Panic();
     }
 
-/*
+    const uint64_t uncached = TimedTests();
+
     common::Log() << "Preparing page tables...\n";
-    memory::AddressSpace aspace;
-    if (!memory::SetupAddressSpace(mmap, &aspace)) {
+    static memory::AddressSpace aspace;
+    if (!memory::SetupAddressSpace(mmap, &aspace) || !MapSerial(&aspace)) {
         common::Log() << "Failed to prepare page tables!\n";
         Panic();
     }
 
     common::Log() << "Installing page tables...\n";
-    if (!memory::SetupMapping(aspace)) {
+    if (!memory::SetupMapping(&aspace)) {
         common::Log() << "Failed to install page tables!\n";
         Panic();
     }
-*/
+
+    const uint64_t cached = TimedTests();
+    common::Log() << "Allocator, cache and vector tests took " << uncached
+          << " us with the MMU off and " << cached << " us with the MMU on\n";
 
     common::Log() << "Initialization complete.\n";
     common::Log() << "Total " << memory::TotalPhysical() << " bytes\n";
@@ -261,12 +1281,34 @@ extern "C" void kernel(struct Data *data, size_t size) {
     CacheTest();
     CacheTest();
 
+    CacheBulkTest();
+    CacheChurnTest();
+    CacheConstructorTest();
+    CacheMergeTest();
+    SmallAllocationTest();
+    NewDeleteTest();
+    AlignedAllocationTest();
+    HotAllocationTest();
+    HeapProfileTest();
+
     common::Log() << "Available after test " << memory::AvailablePhysical() << " bytes\n";
 
     VectorTest();
     VectorTest();
     VectorTest();
 
+    ArenaTest();
+    SortTest();
+    MemoryMapTest();
+    MemoryBatchTest();
+    EarlyAllocatorTest();
+    AddressSpaceTest();
+    TlbTest(&aspace);
+    DemandPagingTest(&aspace);
+    VirtualAllocatorTest();
+
+    memory::DumpCaches();
+
     common::Log() << "Finished.";
 
     Panic();
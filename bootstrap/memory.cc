@@ -4,12 +4,12 @@
 namespace {
 
 template <typename It>
-bool RegisterRegions(It begin, It end, memory::MemoryMap* mmap) {
+bool RegisterRegions(It begin, It end, memory::MemoryBatch* batch) {
     for (It it = begin; it != end; ++it) {
         const uintptr_t from = it->begin;
         const uintptr_t to = from + it->size;
 
-        if (!mmap->Register(from, to, memory::MemoryStatus::FREE)) {
+        if (!batch->Register(from, to, memory::MemoryStatus::FREE)) {
             return false;
         }
     }
@@ -19,13 +19,13 @@ bool RegisterRegions(It begin, It end, memory::MemoryMap* mmap) {
 bool RegisterRegions(
         const fdt::Property& property,
         size_t address, size_t size,
-        memory::MemoryMap* mmap) {
+        memory::MemoryBatch* batch) {
     if (address == 1 && size == 1) {
         fdt::Span<fdt::Range<uint32_t, uint32_t>> span;
         if (!property.ValueAsSpan(&span)) {
             return false;
         }
-        return RegisterRegions(span.ConstBegin(), span.ConstEnd(), mmap);
+        return RegisterRegions(span.ConstBegin(), span.ConstEnd(), batch);
     }
 
     if (address == 2 && size == 2) {
@@ -33,7 +33,7 @@ bool RegisterRegions(
         if (!property.ValueAsSpan(&span)) {
             return false;
         }
-        return RegisterRegions(span.ConstBegin(), span.ConstEnd(), mmap);
+        return RegisterRegions(span.ConstBegin(), span.ConstEnd(), batch);
     }
 
     if (address == 1 && size == 2) {
@@ -41,7 +41,7 @@ bool RegisterRegions(
         if (!property.ValueAsSpan(&span)) {
             return false;
         }
-        return RegisterRegions(span.ConstBegin(), span.ConstEnd(), mmap);
+        return RegisterRegions(span.ConstBegin(), span.ConstEnd(), batch);
     }
 
     if (address == 2 && size == 1) {
@@ -49,7 +49,7 @@ bool RegisterRegions(
         if (!property.ValueAsSpan(&span)) {
             return false;
         }
-        return RegisterRegions(span.ConstBegin(), span.ConstEnd(), mmap);
+        return RegisterRegions(span.ConstBegin(), span.ConstEnd(), batch);
     }
 
     return false;
@@ -57,7 +57,7 @@ bool RegisterRegions(
 
 bool ParseMemoryNode(
         const fdt::Blob& blob, fdt::Scanner pos,
-        size_t address, size_t size, memory::MemoryMap* mmap) {
+        size_t address, size_t size, memory::MemoryBatch* batch) {
     fdt::Node node;
     fdt::Property property;
     fdt::Token token;
@@ -69,7 +69,7 @@ bool ParseMemoryNode(
                 return false;
             }
             if (property.name == "reg") {
-                return RegisterRegions(property, address, size, mmap);
+                return RegisterRegions(property, address, size, batch);
             }
             break;
         case fdt::Token::END_NODE:
@@ -81,7 +81,7 @@ bool ParseMemoryNode(
     return false;
 }
 
-bool RegisterMemory(const fdt::Blob& blob, memory::MemoryMap* mmap) {
+bool RegisterMemory(const fdt::Blob& blob, memory::MemoryBatch* batch) {
     fdt::Scanner pos = blob.Root().offset;
     uint32_t address_cells = 2;
     uint32_t size_cells = 2;
@@ -114,7 +114,7 @@ bool RegisterMemory(const fdt::Blob& blob, memory::MemoryMap* mmap) {
             }
             if (node.name.StartsWith("memory")) {
                 if (!ParseMemoryNode(
-                        blob, pos, address_cells, size_cells, mmap)) {
+                        blob, pos, address_cells, size_cells, batch)) {
                     return false;
                 }
             }
@@ -140,7 +140,9 @@ bool RegisterMemory(const fdt::Blob& blob, memory::MemoryMap* mmap) {
 }  // namespace
 
 bool MMapFromDTB(const fdt::Blob& blob, memory::MemoryMap* mmap) {
-    if (!RegisterMemory(blob, mmap)) {
+    memory::MemoryBatch batch(mmap);
+
+    if (!RegisterMemory(blob, &batch)) {
         return false;
     }
 
@@ -149,10 +151,10 @@ bool MMapFromDTB(const fdt::Blob& blob, memory::MemoryMap* mmap) {
         const uintptr_t begin = it->begin;
         const uintptr_t end = begin + it->size;
 
-        if (!mmap->Reserve(begin, end)) {
+        if (!batch.Reserve(begin, end)) {
             return false;
         }
     }
 
-    return true;
+    return batch.Flush();
 }
@@ -4,6 +4,10 @@
 #include "fdt/blob.h"
 #include "memory/phys.h"
 
+// Registers the memory regions and reserves the reserved ranges listed in the
+// DTB in one MemoryBatch, so the DTB can't list more than 64 of them in total
+// (see MemoryBatch::kMaxUpdates). With more the function fails and the map is
+// left unchanged.
 bool MMapFromDTB(const fdt::Blob& blob, memory::MemoryMap* mmap);
 
 #endif  // __BOOTSTRAP_MEMORY_H__
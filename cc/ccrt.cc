@@ -39,22 +39,6 @@ extern "C" void __cxa_pure_virtual() {
     while (true);
 }
 
-/*
- * TODO: figure out why it's needed and what to do with it.
- *
- * It appears that C++ compiler generates calls to the operator delete for so
- * called deleting destructors. When we define a virtual destructor, compiler
- * treats it somewhat differently from other virtual functions - it actually
- * generates 2 functions: the destructor of the object itself and a deleting
- * destructor.
- *
- * Deleting destructor executes the normal destructor procedure and calls
- * delete operator that typically deallocates memory. One caveat here is that
- * delete operator can be overloaded and the purpose of the deleting destructor
- * is to call the right delete operator in this case.
- */
-void operator delete(void*) {}
-
 /*
  * __constructors is not defined in any ABI I know of, it's just a helper
  * function that bootstrap code can call to run constructors of the static
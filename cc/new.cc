@@ -1,4 +1,9 @@
 #include <new>
 
-void* operator new(size_t, void* ptr) { return ptr; }
+namespace std {
+
+const nothrow_t nothrow{};
 
+}  // namespace std
+
+void* operator new(size_t, void* ptr) { return ptr; }
@@ -1,7 +1,10 @@
 #ifndef __COMMON_ALLOCATOR_H__
 #define __COMMON_ALLOCATOR_H__
 
+#include <algorithm>
+
 #include "memory/memory.h"
+#include "memory/vmalloc.h"
 
 namespace common {
 
@@ -62,11 +65,14 @@ T* PhysicalAllocator<T>::Allocate(size_t size) {
 
 template <typename T>
 bool PhysicalAllocator<T>::Grow(T* ptr, size_t size) {
-    const Header* head = FromPointer(ptr);
+    Header* head = FromPointer(ptr);
     if (head == nullptr) {
         return false;
     }
-    return head->mem.Size() >= AllocationSize(size);
+    if (head->mem.Size() >= AllocationSize(size)) {
+        return true;
+    }
+    return memory::ResizePhysical(&head->mem, AllocationSize(size));
 }
 
 template <typename T>
@@ -82,6 +88,41 @@ bool PhysicalAllocator<T>::Deallocate(T* ptr) {
     return true;
 }
 
+
+// Allocates the memory with AllocateVirtual, so large buffers don't need
+// physically contiguous memory. Buffers only grow in place within the pages
+// that were already allocated.
+template <typename T>
+struct VirtualAllocator {
+    static size_t AllocationSize(size_t size) {
+        return size * sizeof(T);
+    }
+
+    T* Allocate(size_t size);
+    bool Grow(T* ptr, size_t size);
+    bool Deallocate(T* ptr);
+};
+
+template <typename T>
+T* VirtualAllocator<T>::Allocate(size_t size) {
+    return static_cast<T*>(
+        memory::AllocateVirtual(std::max(AllocationSize(size), sizeof(T))));
+}
+
+template <typename T>
+bool VirtualAllocator<T>::Grow(T* ptr, size_t size) {
+    return AllocationSize(size) <= memory::VirtualSize(ptr);
+}
+
+template <typename T>
+bool VirtualAllocator<T>::Deallocate(T* ptr) {
+    if (memory::VirtualSize(ptr) == 0) {
+        return false;
+    }
+    memory::FreeVirtual(ptr);
+    return true;
+}
+
 }  // namespace common
 
 #endif  // __COMMON_ALLOCATOR_H__
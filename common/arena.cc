@@ -0,0 +1,145 @@
+#include "common/arena.h"
+
+#include "common/math.h"
+
+
+namespace common {
+
+Arena::Arena() : Arena(kDefaultChunkSize) {}
+
+Arena::Arena(size_t chunk_size) : chunk_size_(chunk_size) {}
+
+Arena::~Arena() {
+    FreeChunks(chunks_);
+}
+
+void* Arena::Allocate(size_t size, size_t alignment) {
+    uintptr_t addr = AlignUp(top_, static_cast<uintptr_t>(alignment));
+
+    if (chunks_ == nullptr || addr > end_ || end_ - addr < size) {
+        if (AlignUp(sizeof(Chunk), alignment) + size > chunk_size_) {
+            return AllocateDedicated(size, alignment);
+        }
+        if (!NewChunk()) {
+            return nullptr;
+        }
+        addr = AlignUp(top_, static_cast<uintptr_t>(alignment));
+    }
+
+    top_ = addr + size;
+    last_ = addr;
+    last_size_ = size;
+    last_end_ = end_;
+    allocated_ += size;
+    return reinterpret_cast<void*>(addr);
+}
+
+bool Arena::Grow(void* ptr, size_t size) {
+    const uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+
+    if (addr != last_ || last_end_ - addr < size) {
+        return false;
+    }
+
+    allocated_ = allocated_ - last_size_ + size;
+    last_size_ = size;
+    if (last_end_ == end_) {
+        top_ = addr + size;
+    }
+    return true;
+}
+
+void Arena::Reset() {
+    Chunk* keep = nullptr;
+
+    // AllocatePhysical rounds sizes up to a power of two, so chunks of the
+    // default size might be somewhat larger than chunk_size_.
+    if (chunks_ != nullptr && chunks_->mem.Size() < 2 * chunk_size_) {
+        keep = chunks_;
+        chunks_ = chunks_->next;
+        keep->next = nullptr;
+    }
+
+    FreeChunks(chunks_);
+    chunks_ = keep;
+    top_ = 0;
+    end_ = 0;
+    last_ = 0;
+    last_size_ = 0;
+    last_end_ = 0;
+    allocated_ = 0;
+    occupied_ = 0;
+
+    if (keep != nullptr) {
+        top_ = reinterpret_cast<uintptr_t>(keep) + sizeof(Chunk);
+        end_ = keep->mem.ToAddress();
+        occupied_ = keep->mem.Size();
+    }
+}
+
+size_t Arena::Allocated() const { return allocated_; }
+
+size_t Arena::Occupied() const { return occupied_; }
+
+// The current chunk stays first in the list, so that Reset could find it.
+// Without a current chunk the dedicated one goes first, but top_ and end_
+// stay empty and the next allocation starts a new current chunk anyway.
+void* Arena::AllocateDedicated(size_t size, size_t alignment) {
+    Chunk* chunk = AllocateChunk(AlignUp(sizeof(Chunk), alignment) + size);
+    if (chunk == nullptr) {
+        return nullptr;
+    }
+
+    if (chunks_ != nullptr) {
+        chunk->next = chunks_->next;
+        chunks_->next = chunk;
+    } else {
+        chunks_ = chunk;
+    }
+
+    const uintptr_t addr = AlignUp(
+        reinterpret_cast<uintptr_t>(chunk) + sizeof(Chunk),
+        static_cast<uintptr_t>(alignment));
+    last_ = addr;
+    last_size_ = size;
+    last_end_ = chunk->mem.ToAddress();
+    allocated_ += size;
+    return reinterpret_cast<void*>(addr);
+}
+
+Arena::Chunk* Arena::AllocateChunk(size_t size) {
+    auto mem = memory::AllocatePhysical(size);
+    if (!mem) {
+        return nullptr;
+    }
+
+    Chunk* chunk = reinterpret_cast<Chunk*>(mem->FromAddress());
+    chunk->next = nullptr;
+    chunk->mem = *mem;
+    occupied_ += mem->Size();
+    return chunk;
+}
+
+bool Arena::NewChunk() {
+    Chunk* chunk = AllocateChunk(chunk_size_);
+    if (chunk == nullptr) {
+        return false;
+    }
+
+    chunk->next = chunks_;
+    chunks_ = chunk;
+    top_ = chunk->mem.FromAddress() + sizeof(Chunk);
+    end_ = chunk->mem.ToAddress();
+    last_ = 0;
+    return true;
+}
+
+void Arena::FreeChunks(Chunk* chunk) {
+    while (chunk != nullptr) {
+        Chunk* next = chunk->next;
+        memory::FreePhysical(chunk->mem);
+        chunk = next;
+    }
+}
+
+}  // namespace common
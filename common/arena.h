@@ -0,0 +1,112 @@
+#ifndef __COMMON_ARENA_H__
+#define __COMMON_ARENA_H__
+
+#include <cstddef>
+#include <cstdint>
+
+#include "memory/memory.h"
+
+namespace common {
+
+// Arena hands out memory from large chunks allocated with AllocatePhysical
+// by bumping a pointer, individual allocations are never freed, instead all
+// of them are released at once on Reset or when the arena is destroyed.
+// Allocations that don't fit in a chunk get a dedicated chunk of their own,
+// linked behind the current chunk, so that the space left in the current
+// chunk is still used by the following allocations.
+//
+// Arena doesn't call destructors, so it's only suitable for objects with
+// trivial destructors or objects whose destructors are called explicitly.
+class Arena {
+public:
+    static constexpr size_t kDefaultChunkSize = 64 * 1024;
+
+    Arena();
+    explicit Arena(size_t chunk_size);
+    ~Arena();
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    Arena(Arena&&) = delete;
+    Arena& operator=(Arena&&) = delete;
+
+    void* Allocate(size_t size, size_t alignment);
+
+    // The last allocation can be resized in place while there is enough
+    // space left in its chunk, dedicated chunks included.
+    bool Grow(void* ptr, size_t size);
+
+    // Releases all allocations, the most recent chunk is kept for reuse if
+    // it's of the default size.
+    void Reset();
+
+    size_t Allocated() const;
+    size_t Occupied() const;
+
+private:
+    struct Chunk {
+        Chunk* next;
+        memory::Contigous mem;
+    };
+
+    void* AllocateDedicated(size_t size, size_t alignment);
+    Chunk* AllocateChunk(size_t size);
+    bool NewChunk();
+    void FreeChunks(Chunk* chunk);
+
+    size_t chunk_size_;
+    Chunk* chunks_ = nullptr;
+    uintptr_t top_ = 0;
+    uintptr_t end_ = 0;
+    uintptr_t last_ = 0;
+    size_t last_size_ = 0;
+    uintptr_t last_end_ = 0;
+    size_t allocated_ = 0;
+    size_t occupied_ = 0;
+};
+
+
+// Allocator for common::Vector that takes memory from an Arena. Memory is
+// not returned to the arena when the vector is done with it, but growing the
+// vector doesn't need to move the data while it's the last allocation.
+template <typename T>
+class ArenaAllocator {
+public:
+    ArenaAllocator() : arena_(nullptr) {}
+    explicit ArenaAllocator(Arena* arena) : arena_(arena) {}
+
+    ArenaAllocator(const ArenaAllocator& other) = default;
+    ArenaAllocator& operator=(const ArenaAllocator& other) = default;
+
+    T* Allocate(size_t size);
+    bool Grow(T* ptr, size_t size);
+    bool Deallocate(T* ptr);
+
+private:
+    Arena* arena_;
+};
+
+template <typename T>
+T* ArenaAllocator<T>::Allocate(size_t size) {
+    if (arena_ == nullptr) {
+        return nullptr;
+    }
+    return static_cast<T*>(arena_->Allocate(size * sizeof(T), alignof(T)));
+}
+
+template <typename T>
+bool ArenaAllocator<T>::Grow(T* ptr, size_t size) {
+    if (arena_ == nullptr || ptr == nullptr) {
+        return false;
+    }
+    return arena_->Grow(ptr, size * sizeof(T));
+}
+
+template <typename T>
+bool ArenaAllocator<T>::Deallocate(T* ptr) {
+    return ptr != nullptr;
+}
+
+}  // namespace common
+
+#endif  // __COMMON_ARENA_H__
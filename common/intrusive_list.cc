@@ -27,8 +27,6 @@ bool operator!=(const Iterator& l, const Iterator& r) {
 }
 
 
-List::List() { Clear(); }
-
 List::List(List&& other) {
     Clear();
     Splice(Begin(), other);
@@ -40,7 +40,7 @@ bool operator!=(const Iterator& l, const Iterator& r);
 
 class List {
 public:
-    List();
+    constexpr List() : head_{&head_, &head_} {}
 
     List(const List&) = delete;
     List& operator=(const List&) = delete;
@@ -134,7 +134,10 @@ struct IntrusiveListIterator : private impl::Iterator {
 
     friend struct IntrusiveList<T>;
     friend bool operator==(
-        const IntrusiveListIterator& l, const IntrusiveListIterator& r);
+            const IntrusiveListIterator& l, const IntrusiveListIterator& r) {
+        return static_cast<const impl::Iterator&>(l) ==
+            static_cast<const impl::Iterator&>(r);
+    }
 };
 
 
@@ -181,30 +184,20 @@ struct IntrusiveListConstIterator : private impl::Iterator {
 
     friend struct IntrusiveList<T>;
     friend bool operator==(
-        const IntrusiveListConstIterator& l,
-        const IntrusiveListConstIterator& r);
+            const IntrusiveListConstIterator& l,
+            const IntrusiveListConstIterator& r) {
+        return static_cast<const impl::Iterator&>(l) ==
+            static_cast<const impl::Iterator&>(r);
+    }
 };
 
 
-template <typename T>
-bool operator==(
-    const IntrusiveListIterator<T>& l, const IntrusiveListIterator<T>& r) {
-    return static_cast<impl::Iterator>(l) == static_cast<impl::Iterator>(r);
-}
-
 template <typename T>
 bool operator!=(
     const IntrusiveListIterator<T>& l, const IntrusiveListIterator<T>& r) {
     return !(l == r);
 }
 
-template <typename T>
-bool operator==(
-    const IntrusiveListConstIterator<T>& l,
-    const IntrusiveListConstIterator<T>& r) {
-    return static_cast<impl::Iterator>(l) == static_cast<impl::Iterator>(r);
-}
-
 template <typename T>
 bool operator!=(
     const IntrusiveListConstIterator<T>& l,
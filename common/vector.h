@@ -155,9 +155,10 @@ bool Vector<T, A>::Assign(size_t count, const T& item) {
 
 template <typename T, typename A>
 void Vector<T, A>::Swap(Vector& other) {
-    Swap(items_, other.items_);
-    Swap(size_, other.size_);
-    Swap(capacity_, other.capacity_);
+    std::swap(static_cast<A&>(*this), static_cast<A&>(other));
+    std::swap(items_, other.items_);
+    std::swap(size_, other.size_);
+    std::swap(capacity_, other.capacity_);
 }
 
 template <typename T, typename A>
@@ -0,0 +1,210 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "algorithm.h"
+
+namespace {
+
+size_t failures = 0;
+
+void Check(bool condition, const char* what, size_t size, int pattern) {
+    if (!condition) {
+        printf("FAILED: %s, size %zu, pattern %d\n", what, size, pattern);
+        ++failures;
+    }
+}
+
+uint64_t state = 88172645463325252ull;
+
+uint64_t Random() {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+constexpr int kPatterns = 6;
+
+// Random values, many duplicates, sorted, reversed, all equal and a zigzag.
+std::vector<uint64_t> Generate(size_t size, int pattern) {
+    std::vector<uint64_t> data(size);
+    for (size_t i = 0; i < size; ++i) {
+        switch (pattern) {
+        case 0: data[i] = Random(); break;
+        case 1: data[i] = Random() % 4; break;
+        case 2: data[i] = i; break;
+        case 3: data[i] = size - i; break;
+        case 4: data[i] = 7; break;
+        default: data[i] = i % 2 ? i : size - i; break;
+        }
+    }
+    return data;
+}
+
+bool KeyLess(const Pair& l, const Pair& r) {
+    return l.key < r.key;
+}
+
+bool SamePairs(const std::vector<Pair>& l, const std::vector<Pair>& r) {
+    for (size_t i = 0; i < l.size(); ++i) {
+        if (l[i].key != r[i].key || l[i].seq != r[i].seq) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Compares the results of the kernel algorithms with libstdc++ on raw
+// pointers, where the order of the equal elements is specified it has to
+// match as well.
+void CheckAlgorithms(size_t size, int pattern) {
+    const Algorithms& kernel = kKernelAlgorithms;
+    const std::vector<uint64_t> data = Generate(size, pattern);
+    std::vector<uint64_t> sorted = data;
+    std::sort(sorted.begin(), sorted.end());
+    uint64_t* const begin = sorted.data();
+    uint64_t* const end = begin + size;
+
+    std::vector<uint64_t> v = data;
+    kernel.sort(v.data(), v.data() + size);
+    Check(v == sorted, "sort", size, pattern);
+
+    for (int i = 0; i < 50 && size != 0; ++i) {
+        const uint64_t val = i % 2 ? sorted[Random() % size] : Random() % size;
+        Check(kernel.lower_bound(begin, end, val)
+                == std::lower_bound(begin, end, val),
+              "lower_bound", size, pattern);
+        Check(kernel.upper_bound(begin, end, val)
+                == std::upper_bound(begin, end, val),
+              "upper_bound", size, pattern);
+    }
+
+    if (size != 0) {
+        const size_t nth = Random() % size;
+        v = data;
+        kernel.nth_element(v.data(), v.data() + nth, v.data() + size);
+        Check(v[nth] == sorted[nth], "nth_element", size, pattern);
+        for (size_t i = 0; i < size; ++i) {
+            Check(i < nth ? v[i] <= v[nth] : v[i] >= v[nth],
+                  "nth_element order", size, pattern);
+        }
+
+        const uint64_t pivot = data[Random() % size];
+        v = data;
+        uint64_t* middle = kernel.partition(v.data(), v.data() + size, pivot);
+        for (uint64_t* it = v.data(); it != v.data() + size; ++it) {
+            Check(it < middle ? *it < pivot : *it >= pivot,
+                  "partition", size, pattern);
+        }
+        std::sort(v.begin(), v.end());
+        Check(v == sorted, "partition permutation", size, pattern);
+    }
+
+    v = sorted;
+    std::vector<uint64_t> expected = sorted;
+    const size_t unique = kernel.unique(v.data(), v.data() + size) - v.data();
+    expected.erase(std::unique(expected.begin(), expected.end()),
+                   expected.end());
+    v.resize(unique);
+    Check(v == expected, "unique", size, pattern);
+
+    std::vector<Pair> pairs(size);
+    for (size_t i = 0; i < size; ++i) {
+        pairs[i] = Pair{data[i] % 50, i};
+    }
+    std::vector<Pair> stable = pairs;
+    std::stable_sort(stable.begin(), stable.end(), KeyLess);
+    std::vector<Pair> p = pairs;
+    kernel.stable_sort(p.data(), p.data() + size);
+    Check(SamePairs(p, stable), "stable_sort", size, pattern);
+
+    // Both halves are sorted, the merge has to put them together.
+    const size_t half = size / 3;
+    v = data;
+    std::sort(v.begin(), v.begin() + half);
+    std::sort(v.begin() + half, v.end());
+    std::vector<uint64_t> merged(size);
+    kernel.merge(
+        v.data(), v.data() + half, v.data() + half, v.data() + size,
+        merged.data());
+    Check(merged == sorted, "merge", size, pattern);
+
+    for (size_t i = 0; i < size; ++i) {
+        pairs[i] = Pair{v[i] % 10, i};
+    }
+    std::stable_sort(pairs.begin(), pairs.begin() + half, KeyLess);
+    std::stable_sort(pairs.begin() + half, pairs.end(), KeyLess);
+    p = pairs;
+    std::inplace_merge(pairs.begin(), pairs.begin() + half, pairs.end(),
+                       KeyLess);
+    kernel.inplace_merge(p.data(), p.data() + half, p.data() + size);
+    Check(SamePairs(p, pairs), "inplace_merge", size, pattern);
+}
+
+double Now() {
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Benchmark(const Algorithms& algorithms) {
+    constexpr size_t kSize = 1 << 20;
+    constexpr size_t kLookups = 4000000;
+    const std::vector<uint64_t> data = Generate(kSize, 0);
+
+    std::vector<uint64_t> v = data;
+    double start = Now();
+    algorithms.sort(v.data(), v.data() + kSize);
+    printf("%s: sort of 1M values: %.1f ms\n",
+           algorithms.name, (Now() - start) * 1e3);
+
+    std::vector<Pair> pairs(kSize);
+    for (size_t i = 0; i < kSize; ++i) {
+        pairs[i] = Pair{data[i] % 1000, i};
+    }
+    start = Now();
+    algorithms.stable_sort(pairs.data(), pairs.data() + kSize);
+    printf("%s: stable_sort of 1M pairs: %.1f ms\n",
+           algorithms.name, (Now() - start) * 1e3);
+
+    v = data;
+    start = Now();
+    algorithms.nth_element(v.data(), v.data() + kSize / 2, v.data() + kSize);
+    printf("%s: nth_element of 1M values: %.1f ms\n",
+           algorithms.name, (Now() - start) * 1e3);
+
+    std::vector<uint64_t> sorted = data;
+    std::sort(sorted.begin(), sorted.end());
+    for (size_t size : { size_t(128), size_t(4096), kSize }) {
+        uint64_t sum = 0;
+        start = Now();
+        for (size_t i = 0; i < kLookups; ++i) {
+            sum += algorithms.lower_bound(
+                sorted.data(), sorted.data() + size, Random()) - sorted.data();
+        }
+        printf("%s: lower_bound in %zu values: %.1f ns (%llu)\n",
+               algorithms.name, size, (Now() - start) * 1e9 / kLookups,
+               static_cast<unsigned long long>(sum % 10));
+    }
+}
+
+}  // namespace
+
+int main() {
+    constexpr size_t kSizes[] = { 0, 1, 2, 3, 5, 16, 17, 31, 100, 1000, 4097 };
+
+    for (size_t size : kSizes) {
+        for (int pattern = 0; pattern < kPatterns; ++pattern) {
+            for (int round = 0; round < 20; ++round) {
+                CheckAlgorithms(size, pattern);
+            }
+        }
+    }
+    printf("%zu failures\n", failures);
+
+    Benchmark(kKernelAlgorithms);
+    Benchmark(kStdAlgorithms);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,38 @@
+#ifndef __HOST_ALGORITHM_H__
+#define __HOST_ALGORITHM_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The algorithms from cc/algorithm and their libstdc++ counterparts
+// instantiated for the same types, so that the results and the timings
+// could be compared. The two can't be included in the same translation
+// unit, both define namespace std.
+
+struct Pair {
+    uint64_t key;
+    uint64_t seq;
+};
+
+struct Algorithms {
+    const char* name;
+    void (*sort)(uint64_t* first, uint64_t* last);
+    // Pairs are ordered by the key only.
+    void (*stable_sort)(Pair* first, Pair* last);
+    void (*nth_element)(uint64_t* first, uint64_t* nth, uint64_t* last);
+    uint64_t* (*lower_bound)(uint64_t* first, uint64_t* last, uint64_t val);
+    uint64_t* (*upper_bound)(uint64_t* first, uint64_t* last, uint64_t val);
+    uint64_t* (*unique)(uint64_t* first, uint64_t* last);
+    // Moves the values less than pivot to the front.
+    uint64_t* (*partition)(uint64_t* first, uint64_t* last, uint64_t pivot);
+    uint64_t* (*merge)(
+        uint64_t* first1, uint64_t* last1,
+        uint64_t* first2, uint64_t* last2,
+        uint64_t* out);
+    void (*inplace_merge)(Pair* first, Pair* middle, Pair* last);
+};
+
+extern const Algorithms kKernelAlgorithms;
+extern const Algorithms kStdAlgorithms;
+
+#endif  // __HOST_ALGORITHM_H__
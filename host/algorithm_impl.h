@@ -0,0 +1,50 @@
+// Included by algorithm_kernel.cc and algorithm_std.cc with ALGORITHMS set
+// to the namespace with the implementation.
+
+namespace {
+
+bool KeyLess(const Pair& l, const Pair& r) {
+    return l.key < r.key;
+}
+
+void Sort(uint64_t* first, uint64_t* last) {
+    ALGORITHMS::sort(first, last);
+}
+
+void StableSort(Pair* first, Pair* last) {
+    ALGORITHMS::stable_sort(first, last, KeyLess);
+}
+
+void NthElement(uint64_t* first, uint64_t* nth, uint64_t* last) {
+    ALGORITHMS::nth_element(first, nth, last);
+}
+
+uint64_t* LowerBound(uint64_t* first, uint64_t* last, uint64_t val) {
+    return ALGORITHMS::lower_bound(first, last, val);
+}
+
+uint64_t* UpperBound(uint64_t* first, uint64_t* last, uint64_t val) {
+    return ALGORITHMS::upper_bound(first, last, val);
+}
+
+uint64_t* Unique(uint64_t* first, uint64_t* last) {
+    return ALGORITHMS::unique(first, last);
+}
+
+uint64_t* Partition(uint64_t* first, uint64_t* last, uint64_t pivot) {
+    return ALGORITHMS::partition(
+        first, last, [pivot](uint64_t x) { return x < pivot; });
+}
+
+uint64_t* Merge(
+        uint64_t* first1, uint64_t* last1,
+        uint64_t* first2, uint64_t* last2,
+        uint64_t* out) {
+    return ALGORITHMS::merge(first1, last1, first2, last2, out);
+}
+
+void InplaceMerge(Pair* first, Pair* middle, Pair* last) {
+    ALGORITHMS::inplace_merge(first, middle, last, KeyLess);
+}
+
+}  // namespace
@@ -0,0 +1,16 @@
+// The kernel headers from cc/ put everything in namespace std, so it's
+// renamed to not clash with libstdc++ linked into the same binary.
+#define std kernel
+#include <algorithm>
+#undef std
+
+#include "algorithm.h"
+
+#define ALGORITHMS kernel
+#include "algorithm_impl.h"
+
+const Algorithms kKernelAlgorithms = {
+    "cc/algorithm",
+    Sort, StableSort, NthElement, LowerBound, UpperBound,
+    Unique, Partition, Merge, InplaceMerge,
+};
@@ -0,0 +1,12 @@
+#include <algorithm>
+
+#include "algorithm.h"
+
+#define ALGORITHMS std
+#include "algorithm_impl.h"
+
+const Algorithms kStdAlgorithms = {
+    "libstdc++",
+    Sort, StableSort, NthElement, LowerBound, UpperBound,
+    Unique, Partition, Merge, InplaceMerge,
+};
@@ -0,0 +1,449 @@
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#include "common/logging.h"
+#include "host/harness.h"
+#include "memory/alloc.h"
+#include "memory/cache.h"
+#include "memory/profile.h"
+
+extern "C" {
+#include <pthread.h>
+#include <sched.h>
+}
+
+namespace {
+
+// The same as HotAllocationTest in bootstrap/main.cc.
+void HotAllocationBenchmark() {
+    constexpr size_t kRounds = 10000000;
+    constexpr size_t kSizes[] = { 16, 64, 256 };
+
+    for (size_t size : kSizes) {
+        const uint64_t start = Counter();
+        for (size_t i = 0; i < kRounds; ++i) {
+            void* ptr = memory::Allocate(size);
+            Check(ptr != nullptr, "memory::Allocate");
+            memory::Free(ptr, size);
+        }
+        const uint64_t ns = Counter() - start;
+
+        common::Log() << "Allocated and freed " << size << " bytes "
+              << kRounds << " times in " << ns / kRounds
+              << " ns per pair\n";
+    }
+
+    memory::FlushCpuCache();
+}
+
+void ReallocateTest() {
+    void* ptr = memory::Reallocate(nullptr, 100);
+    Check(ptr != nullptr, "Reallocate of nullptr allocates");
+    memset(ptr, 0xab, 100);
+
+    void* grown = memory::Reallocate(ptr, 1000);
+    Check(grown != nullptr, "Reallocate grows the allocation");
+    Check(static_cast<uint8_t*>(grown)[99] == 0xab,
+          "Reallocate keeps the contents");
+    memory::Free(grown);
+    memory::FlushCpuCache();
+}
+
+void AlignedAllocationTest() {
+    constexpr size_t kMaxSize = ~static_cast<size_t>(0);
+
+    Check(memory::AllocateAligned(kMaxSize, 16) == nullptr,
+          "the largest size cannot be aligned");
+    Check(memory::AllocateAligned(kMaxSize - 8, 16) == nullptr,
+          "aligned size doesn't wrap around");
+
+    void* ptr = memory::AllocateAligned(100, 64);
+    Check(ptr != nullptr, "aligned allocation");
+    Check(reinterpret_cast<uintptr_t>(ptr) % 64 == 0, "allocation alignment");
+    memory::FreeAligned(ptr, 100, 64);
+    memory::FlushCpuCache();
+}
+
+// With the period of one byte every allocation is sampled with its size, so
+// the profile has to follow the sizes of the allocations that Reallocate
+// resizes in place as well as of the ones it moves.
+void HeapProfileReallocateTest() {
+    constexpr size_t kLarge = 64 * 1024;
+    constexpr size_t kSmall = 1000;
+    const void* all_begin = reinterpret_cast<const void*>(0);
+    const void* all_end = reinterpret_cast<const void*>(~uintptr_t(0));
+
+    memory::StartHeapProfile(1);
+    void* large = memory::Allocate(kLarge);
+    void* small = memory::Allocate(kSmall);
+    Check(large != nullptr && small != nullptr, "profiled allocations");
+    Check(memory::HeapProfileBytes(all_begin, all_end) == kLarge + kSmall,
+          "every allocation is sampled");
+
+    large = memory::Reallocate(large, 2 * kLarge);
+    Check(large != nullptr, "profiled growth");
+    Check(memory::HeapProfileBytes(all_begin, all_end) == 2 * kLarge + kSmall,
+          "profile follows the growth");
+
+    void* shrunk = memory::Reallocate(large, kLarge / 2);
+    Check(shrunk == large, "large allocation shrinks in place");
+    void* small_shrunk = memory::Reallocate(small, kSmall / 2);
+    Check(small_shrunk == small, "small allocation shrinks in place");
+    Check(memory::HeapProfileBytes(all_begin, all_end)
+              == kLarge / 2 + kSmall / 2,
+          "profile follows the in place resizes");
+
+    memory::Free(large);
+    memory::Free(small);
+    memory::StopHeapProfile();
+    Check(memory::HeapProfileBytes(all_begin, all_end) == 0,
+          "no live samples after the frees");
+    memory::FlushCpuCache();
+}
+
+// Frees objects one by one and in bursts, both in the allocation order and
+// scattered over many slabs, FreeBulk must not be slower than separate Free
+// calls in either case. Every configuration reports the fastest round, the
+// host is too noisy for the averages to be comparable.
+uint64_t FreeRound(memory::Cache* cache, void** objects, size_t count,
+                   bool shuffle, bool bulk, uint64_t* state) {
+    constexpr size_t kBurst = 256;
+
+    Check(cache->AllocateBulk(objects, count) == count, "bulk allocation");
+    for (size_t i = count - 1; shuffle && i > 0; --i) {
+        *state = *state * 6364136223846793005ull + 1442695040888963407ull;
+        std::swap(objects[i], objects[(*state >> 33) % (i + 1)]);
+    }
+
+    const uint64_t start = Counter();
+    size_t freed = 0;
+    for (size_t i = 0; i < count; i += kBurst) {
+        if (bulk) {
+            freed += cache->FreeBulk(objects + i, kBurst);
+            continue;
+        }
+        for (size_t j = i; j < i + kBurst; ++j) {
+            freed += cache->Free(objects[j]) ? 1 : 0;
+        }
+    }
+    const uint64_t ns = Counter() - start;
+
+    Check(freed == count, "all objects freed");
+    return ns / count;
+}
+
+void BulkFreeBenchmark() {
+    constexpr size_t kObjects = 1 << 16;
+    constexpr size_t kRounds = 16;
+    static void* objects[kObjects];
+    memory::Cache cache("bulk-free-test", 64, 8);
+    uint64_t state = 1;
+
+    for (int pattern = 0; pattern < 2; ++pattern) {
+        const bool shuffle = pattern != 0;
+        uint64_t single = ~static_cast<uint64_t>(0);
+        uint64_t bulk = ~static_cast<uint64_t>(0);
+
+        // Every round the other way of freeing goes first, so that neither
+        // of them benefits from the order.
+        for (size_t round = 0; round < kRounds; ++round) {
+            for (size_t i = 0; i < 2; ++i) {
+                if ((round + i) % 2 == 0) {
+                    single = std::min(single, FreeRound(
+                        &cache, objects, kObjects, shuffle, false, &state));
+                } else {
+                    bulk = std::min(bulk, FreeRound(
+                        &cache, objects, kObjects, shuffle, true, &state));
+                }
+            }
+        }
+
+        common::Log() << "Freed " << kObjects
+              << (shuffle ? " scattered" : " sequential")
+              << " objects in " << single << " ns per Free and "
+              << bulk << " ns per object with FreeBulk\n";
+    }
+
+    Check(cache.Allocated() == 0, "bulk free accounting");
+    cache.Reclaim();
+}
+
+// Objects allocated on CPU 0 and freed on CPU 1 go to the remote free list
+// of CPU 0 and only come back to the slabs when CPU 0 drains it.
+void RemoteFreeTest() {
+    constexpr size_t kObjects = 1000;
+    static void* objects[kObjects];
+    memory::Cache cache("remote-test", 64, 8);
+
+    for (size_t i = 0; i < kObjects; ++i) {
+        objects[i] = cache.Allocate();
+        Check(objects[i] != nullptr, "remote test allocation");
+    }
+    const size_t occupied = cache.Occupied();
+
+    SwitchCpu(1);
+    for (size_t i = 0; i < kObjects; ++i) {
+        Check(cache.Free(objects[i]), "remote free");
+    }
+    Check(!cache.Reclaim(), "CPU without slabs has nothing to reclaim");
+    SwitchCpu(0);
+
+    Check(cache.Allocated() == 0, "remote frees are accounted right away");
+    Check(cache.Occupied() == occupied, "remote frees keep the slabs");
+
+    // CPU 0 runs out of partial slabs and drains the remote free list
+    // instead of allocating new slabs.
+    for (size_t i = 0; i < kObjects; ++i) {
+        objects[i] = cache.Allocate();
+        Check(objects[i] != nullptr, "allocation after remote frees");
+    }
+    Check(cache.Allocated() == kObjects * cache.ObjectSize(),
+          "drained objects are allocated again");
+    Check(cache.Occupied() == occupied, "no new slabs");
+
+    for (size_t i = 0; i < kObjects; ++i) {
+        Check(cache.Free(objects[i]), "local free");
+        objects[i] = nullptr;
+    }
+    Check(cache.Allocated() == 0, "local frees after remote ones");
+    Check(cache.Reclaim(), "CPU 0 reclaims drained slabs");
+    Check(cache.Occupied() == 0, "all slabs reclaimed");
+}
+
+// Every CPU allocates from its own slabs of the same cache, including the
+// size class caches behind memory::Allocate, and frees objects of the other.
+void CpuSlabsTest() {
+    constexpr size_t kObjects = 1000;
+    constexpr size_t kSize = 200;
+    static void* objects[2][kObjects];
+    static void* blocks[2][kObjects];
+    memory::Cache cache("cpu-slabs-test", 64, 8);
+
+    for (uint64_t cpu = 0; cpu < 2; ++cpu) {
+        SwitchCpu(cpu);
+        for (size_t i = 0; i < kObjects; ++i) {
+            objects[cpu][i] = cache.Allocate();
+            Check(objects[cpu][i] != nullptr, "per CPU allocation");
+            blocks[cpu][i] = memory::Allocate(kSize);
+            Check(blocks[cpu][i] != nullptr, "memory::Allocate on every CPU");
+        }
+    }
+    const size_t occupied = cache.Occupied();
+    Check(occupied >= 2 * kObjects * cache.ObjectSize(),
+          "every CPU has its own slabs");
+
+    for (uint64_t cpu = 0; cpu < 2; ++cpu) {
+        SwitchCpu(cpu);
+        for (size_t i = 0; i < kObjects; ++i) {
+            Check(cache.Free(objects[1 - cpu][i]), "free of the other CPU");
+            memory::Free(blocks[1 - cpu][i], kSize);
+        }
+    }
+    Check(cache.Allocated() == 0, "all objects freed");
+
+    for (uint64_t cpu = 0; cpu < 2; ++cpu) {
+        SwitchCpu(cpu);
+        Check(cache.Reclaim(), "every CPU reclaims its slabs");
+        memory::FlushCpuCache();
+    }
+    SwitchCpu(0);
+    Check(cache.Occupied() == 0, "all slabs reclaimed");
+}
+
+// CPU 0 allocates objects and passes them through a ring to a thread
+// running on CPU 1, that frees them concurrently with CPU 0 allocating and
+// draining the remote free list, and allocates from the same cache itself.
+// The host might have fewer CPUs than threads, so both sides yield while
+// waiting on the ring.
+struct Ring {
+    static constexpr size_t kSize = 1024;
+
+    memory::Cache* cache;
+    size_t objects;
+    void* slots[kSize];
+    size_t head = 0;
+    size_t tail = 0;
+    size_t corrupted = 0;
+};
+
+// The second word of the object keeps its number, the first one is used by
+// the free lists.
+void* RemoteFreeThread(void* arg) {
+    Ring* ring = static_cast<Ring*>(arg);
+
+    SwitchCpu(1);
+    for (size_t i = 0; i < ring->objects; ++i) {
+        const size_t tail = ring->tail;
+        while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) {
+            sched_yield();
+        }
+
+        uint64_t* object =
+            static_cast<uint64_t*>(ring->slots[tail % Ring::kSize]);
+        if (object[1] != i) {
+            ++ring->corrupted;
+        }
+        ring->cache->Free(object);
+        __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+        uint64_t* own = static_cast<uint64_t*>(ring->cache->Allocate());
+        if (own == nullptr) {
+            ++ring->corrupted;
+            continue;
+        }
+        own[1] = i;
+        ring->cache->Free(own);
+    }
+    return nullptr;
+}
+
+void ConcurrentRemoteFreeTest() {
+    constexpr size_t kObjects = 1000000;
+    memory::Cache cache("concurrent-remote-test", 64, 8);
+    static Ring ring;
+    ring.cache = &cache;
+    ring.objects = kObjects;
+
+    pthread_t thread;
+    if (pthread_create(&thread, nullptr, &RemoteFreeThread, &ring) != 0) {
+        Check(false, "pthread_create");
+        return;
+    }
+
+    size_t max_occupied = 0;
+    for (size_t i = 0; i < kObjects; ++i) {
+        uint64_t* object = static_cast<uint64_t*>(cache.Allocate());
+        Check(object != nullptr, "concurrent allocation");
+        object[1] = i;
+        max_occupied = std::max(max_occupied, cache.Occupied());
+
+        const size_t head = ring.head;
+        while (head - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE)
+                == Ring::kSize) {
+            sched_yield();
+        }
+        ring.slots[head % Ring::kSize] = object;
+        __atomic_store_n(&ring.head, head + 1, __ATOMIC_RELEASE);
+    }
+    pthread_join(thread, nullptr);
+    Check(ring.corrupted == 0, "objects are handed out once");
+
+    Check(cache.Allocated() == 0, "all remote frees are accounted");
+    Check(cache.Reclaim(), "CPU 0 reclaims drained slabs");
+    SwitchCpu(1);
+    Check(cache.Reclaim(), "CPU 1 reclaims its slabs");
+    SwitchCpu(0);
+    Check(cache.Occupied() == 0, "all slabs reclaimed");
+    common::Log() << "Freed " << kObjects << " objects on another CPU with "
+          << max_occupied << " bytes of slabs at most, "
+          << ring.corrupted << " corrupted\n";
+}
+
+// A short-lived cache registers first, but only the static cache registered
+// after it becomes the merge target of the two long-lived caches. The static
+// cache is destroyed anyway, the first of the long-lived caches has to take
+// over the slabs with the objects of both.
+void MergeTargetTest() {
+    constexpr size_t kObjects = 1000;
+    static uint64_t* objects[2][kObjects];
+    memory::Cache heir("merge-heir", 40, 8);
+    memory::Cache alias("merge-alias", 40, 8);
+    memory::Cache* caches[] = { &heir, &alias };
+    size_t occupied = 0;
+
+    {
+        memory::Cache scoped("merge-scoped", 40, 8);
+        void* scoped_ptr = scoped.Allocate();
+        Check(scoped_ptr != nullptr, "scoped cache allocation");
+
+        memory::Cache target("merge-target", 40, 8, memory::kCacheStatic);
+        void* ptr = target.Allocate();
+        Check(ptr != nullptr, "merge target allocation");
+
+        for (size_t c = 0; c < 2; ++c) {
+            for (size_t i = 0; i < kObjects; ++i) {
+                objects[c][i] = static_cast<uint64_t*>(caches[c]->Allocate());
+                Check(objects[c][i] != nullptr, "merged allocation");
+                objects[c][i][1] = i;
+            }
+        }
+        Check(heir.Occupied() == target.Occupied(), "heir is merged");
+        Check(heir.Occupied() != scoped.Occupied(),
+              "scoped cache is not a merge target");
+        Check(target.Allocated() == target.ObjectSize(),
+              "target counts only its own objects");
+
+        scoped.Free(scoped_ptr);
+        target.Free(ptr);
+        occupied = target.Occupied();
+    }
+
+    Check(heir.Occupied() == occupied, "heir took over the slabs");
+    Check(alias.Occupied() == occupied, "alias is merged into the heir");
+    Check(heir.Allocated() == kObjects * heir.ObjectSize(),
+          "heir keeps its own accounting");
+    Check(alias.Allocated() == kObjects * alias.ObjectSize(),
+          "alias keeps its own accounting");
+
+    for (size_t c = 0; c < 2; ++c) {
+        for (size_t i = 0; i < kObjects; ++i) {
+            Check(objects[c][i][1] == i, "merged object kept its contents");
+            Check(caches[c]->Free(objects[c][i]), "merged free");
+        }
+    }
+    Check(heir.Allocated() == 0, "all merged objects freed");
+    Check(alias.Allocated() == 0, "all alias objects freed");
+    Check(heir.Reclaim(), "heir reclaims the slabs");
+    Check(heir.Occupied() == 0, "all merged slabs reclaimed");
+}
+
+// A cache marked with kCacheNoMerge keeps its own slabs even when a static
+// cache with the same layout is registered.
+void NoMergeTest() {
+    memory::Cache target("no-merge-target", 40, 8, memory::kCacheStatic);
+    memory::Cache apart("no-merge", 40, 8, memory::kCacheNoMerge);
+
+    void* ptr = target.Allocate();
+    Check(ptr != nullptr, "merge target allocation");
+    void* own = apart.Allocate();
+    Check(own != nullptr, "no-merge allocation");
+
+    target.Free(ptr);
+    target.Reclaim();
+    Check(target.Occupied() == 0, "no-merge cache has its own slabs");
+
+    apart.Free(own);
+    Check(apart.Reclaim(), "no-merge cache reclaims its slabs");
+    Check(apart.Occupied() == 0, "all no-merge slabs reclaimed");
+}
+
+}  // namespace
+
+int main() {
+    constexpr size_t kMemory = static_cast<size_t>(64) << 20;
+
+    if (!SetupHarness(kMemory)) {
+        common::Log() << "Failed to setup the allocator\n";
+        return 1;
+    }
+
+    HotAllocationBenchmark();
+    ReallocateTest();
+    AlignedAllocationTest();
+    HeapProfileReallocateTest();
+
+    // The test caches must not be merged with the global ones.
+    memory::SetCacheMerging(false);
+    BulkFreeBenchmark();
+    RemoteFreeTest();
+    CpuSlabsTest();
+    ConcurrentRemoteFreeTest();
+    memory::SetCacheMerging(true);
+    MergeTargetTest();
+    NoMergeTest();
+
+    common::Log() << Failures() << " failures\n";
+    return Failures() == 0 ? 0 : 1;
+}
@@ -0,0 +1,66 @@
+#ifndef __MEMORY_ARCH_H__
+#define __MEMORY_ARCH_H__
+
+#include <cstdint>
+
+// The host replacement for memory/arch.h, the Makefile puts it in place of
+// the original. System registers are plain variables and the barriers, the
+// cache and the TLB maintenance do nothing, since the translation tables
+// built on the host are never used by the hardware.
+//
+// Every host thread pretends to run on the CPU set in host::cpu, by default
+// CPU 0, and every emulated CPU has its own TPIDR_EL2.
+
+namespace memory {
+
+namespace host {
+
+constexpr uint64_t kCpus = 8;
+
+inline thread_local uint64_t cpu = 0;
+inline uintptr_t tpidr[kCpus] = {};
+
+inline uint64_t mair = 0;
+inline uintptr_t ttbr0 = 0;
+inline uint64_t tcr = 0;
+inline uint64_t sctlr = 0;
+
+}  // namespace host
+
+inline void SetMairEl2(uint64_t mair) { host::mair = mair; }
+inline uint64_t GetMairEl2() { return host::mair; }
+inline void SetTtbar0El2(uintptr_t ttbr) { host::ttbr0 = ttbr; }
+inline uintptr_t GetTtbar0El2() { return host::ttbr0; }
+inline void SetTcrEl2(uint64_t tcr) { host::tcr = tcr; }
+inline uint64_t GetTcrEl2() { return host::tcr; }
+inline void SetSctlrEl2(uint64_t sctlr) { host::sctlr = sctlr; }
+inline uint64_t GetSctlrEl2() { return host::sctlr; }
+
+// 4 KiB granule and 48 bit physical addresses.
+inline uint64_t GetIdAa64Mmfr0El1() { return 0x5; }
+inline uint64_t GetIdAa64Mmfr2El1() { return 0; }
+// No range TLB invalidations.
+inline uint64_t GetIdAa64Isar0El1() { return 0; }
+// No caches to maintain.
+inline uint64_t GetClidrEl1() { return 0; }
+inline void SetCsselrEl1(uint64_t) {}
+inline uint64_t GetCcsidrEl1() { return 0; }
+
+inline void DcIsw(uint64_t) {}
+inline void IcIallu() {}
+inline void DsbIshSt() { __atomic_thread_fence(__ATOMIC_RELEASE); }
+inline void DsbIsh() { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+inline void Isb() {}
+inline void TlbiAllE2Is() {}
+inline void TlbiVae2Is(uint64_t) {}
+inline void TlbiRvae2Is(uint64_t) {}
+
+inline void Yield() {}
+
+inline uint64_t GetMpidrEl1() { return host::cpu; }
+inline uintptr_t GetTpidrEl2() { return host::tpidr[host::cpu]; }
+inline void SetTpidrEl2(uintptr_t tpidr) { host::tpidr[host::cpu] = tpidr; }
+
+}  // namespace memory
+
+#endif  // __MEMORY_ARCH_H__
@@ -0,0 +1,66 @@
+#include "harness.h"
+
+#include "common/logging.h"
+#include "memory/arch.h"
+#include "memory/memory.h"
+#include "memory/phys.h"
+
+extern "C" {
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+}
+
+namespace {
+
+class StdoutStream : public common::OutputStream {
+public:
+    int Put(char c) override {
+        return putchar(c) == EOF ? 0 : 1;
+    }
+};
+
+size_t failures = 0;
+
+}  // namespace
+
+bool SetupHarness(size_t memory) {
+    static StdoutStream stream;
+    static memory::MemoryMap mmap;
+
+    common::RegisterLog(&stream);
+
+    // Like the RAM of a real board the memory is aligned, so that the buddy
+    // allocator could use the large blocks.
+    void* ptr = aligned_alloc(memory, memory);
+    if (ptr == nullptr) {
+        return false;
+    }
+
+    const uintptr_t begin = reinterpret_cast<uintptr_t>(ptr);
+    if (!mmap.Register(begin, begin + memory, memory::MemoryStatus::FREE)) {
+        return false;
+    }
+    return memory::SetupAllocator(&mmap);
+}
+
+uint64_t Counter() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+void SwitchCpu(uint64_t cpu) {
+    memory::host::cpu = cpu;
+}
+
+void Check(bool condition, const char* what) {
+    if (!condition) {
+        common::Log() << "FAILED: " << what << "\n";
+        ++failures;
+    }
+}
+
+size_t Failures() {
+    return failures;
+}
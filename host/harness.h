@@ -0,0 +1,22 @@
+#ifndef __HOST_HARNESS_H__
+#define __HOST_HARNESS_H__
+
+#include <cstddef>
+#include <cstdint>
+
+// Gives the allocator a chunk of the host memory and sends the log to the
+// standard output.
+bool SetupHarness(size_t memory);
+
+// Monotonic time in nanoseconds.
+uint64_t Counter();
+
+// Switches the emulated CPU of the calling thread, see host/arch.h.
+void SwitchCpu(uint64_t cpu);
+
+// Tests call Check for every condition they verify, Failures returns the
+// number of the conditions that didn't hold so far.
+void Check(bool condition, const char* what);
+size_t Failures();
+
+#endif  // __HOST_HARNESS_H__
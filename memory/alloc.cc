@@ -1,121 +1,340 @@
 #include "alloc.h"
 
+#include <algorithm>
 #include <cstring>
 
+#include "arch.h"
 #include "cache.h"
 #include "memory.h"
+#include "profile.h"
 #include "common/math.h"
 
 namespace memory {
 
 namespace {
 
-constexpr size_t kMaxAlignment = 32;
-
-struct Metadata {
-    Cache* cache;
-    Contigous mem;   
+// Size classes follow a geometric progression with four classes per
+// power of two (like in jemalloc), which bounds the internal
+// fragmentation by 25% while keeping the number of caches small.
+constexpr size_t kSizeClasses[] = {
+    8, 16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448,
+    512, 640, 768, 896, 1024, 1280, 1536, 1792, 2048, 2560, 3072, 3584,
+    4096,
 };
 
+constexpr size_t kClasses = sizeof(kSizeClasses)/sizeof(kSizeClasses[0]);
+constexpr size_t kQuantum = 8;
+constexpr size_t kMaxSmallSize = kSizeClasses[kClasses - 1];
+
 Cache caches[] = {
-    Cache(128, 128),
-    Cache(256, 256),
-    Cache(384, 384),
-    Cache(512, 512),
-    Cache(640, 640),
-    Cache(768, 768),
-    Cache(896, 896),
-    Cache(1024, 1024),
-    Cache(1152, 1152),
-    Cache(1280, 1280),
-    Cache(1408, 1408),
-    Cache(1536, 1536),
-    Cache(1664, 1664),
-    Cache(1792, 1792),
-    Cache(1920, 1920),
-    Cache(2048, 2048),
-    Cache(2176, 2176),
-    Cache(2304, 2304),
-    Cache(2432, 2432),
-    Cache(2560, 2560),
-    Cache(2688, 2688),
-    Cache(2816, 2816),
-    Cache(2944, 2944),
-    Cache(3072, 3072),
-    Cache(3200, 3200),
-    Cache(3328, 3328),
-    Cache(3456, 3456),
-    Cache(3584, 3584),
-    Cache(3712, 3712),
-    Cache(3840, 3840),
-    Cache(3968, 3968),
-    Cache(4096, 4096),
+    Cache("alloc-8", 8, 8, kCacheStatic),
+    Cache("alloc-16", 16, 16, kCacheStatic),
+    Cache("alloc-32", 32, 32, kCacheStatic),
+    Cache("alloc-48", 48, 16, kCacheStatic),
+    Cache("alloc-64", 64, 64, kCacheStatic),
+    Cache("alloc-80", 80, 16, kCacheStatic),
+    Cache("alloc-96", 96, 32, kCacheStatic),
+    Cache("alloc-112", 112, 16, kCacheStatic),
+    Cache("alloc-128", 128, 128, kCacheStatic),
+    Cache("alloc-160", 160, 32, kCacheStatic),
+    Cache("alloc-192", 192, 64, kCacheStatic),
+    Cache("alloc-224", 224, 32, kCacheStatic),
+    Cache("alloc-256", 256, 256, kCacheStatic),
+    Cache("alloc-320", 320, 64, kCacheStatic),
+    Cache("alloc-384", 384, 128, kCacheStatic),
+    Cache("alloc-448", 448, 64, kCacheStatic),
+    Cache("alloc-512", 512, 512, kCacheStatic),
+    Cache("alloc-640", 640, 128, kCacheStatic),
+    Cache("alloc-768", 768, 256, kCacheStatic),
+    Cache("alloc-896", 896, 128, kCacheStatic),
+    Cache("alloc-1024", 1024, 1024, kCacheStatic),
+    Cache("alloc-1280", 1280, 256, kCacheStatic),
+    Cache("alloc-1536", 1536, 512, kCacheStatic),
+    Cache("alloc-1792", 1792, 256, kCacheStatic),
+    Cache("alloc-2048", 2048, 2048, kCacheStatic),
+    Cache("alloc-2560", 2560, 512, kCacheStatic),
+    Cache("alloc-3072", 3072, 1024, kCacheStatic),
+    Cache("alloc-3584", 3584, 512, kCacheStatic),
+    Cache("alloc-4096", 4096, 4096, kCacheStatic),
 };
 
+static_assert(sizeof(caches)/sizeof(caches[0]) == kClasses,
+              "Every size class must have a cache.");
+
+// Maps a size rounded up to kQuantum to the index of the smallest size class
+// that can fit it, so that finding a cache for an allocation is a single
+// table lookup.
+struct ClassTable {
+    uint8_t index[kMaxSmallSize / kQuantum + 1];
+};
+
+constexpr ClassTable MakeClassTable() {
+    ClassTable table{};
+    size_t cls = 0;
+    for (size_t i = 0; i <= kMaxSmallSize / kQuantum; ++i) {
+        while (kSizeClasses[cls] < i * kQuantum) {
+            ++cls;
+        }
+        table.index[i] = static_cast<uint8_t>(cls);
+    }
+    return table;
+}
+
+constexpr ClassTable kClassTable = MakeClassTable();
+
+static_assert(kSizeClasses[kClassTable.index[1]] == 8, "");
+static_assert(kSizeClasses[kClassTable.index[5]] == 48, "");
+static_assert(kSizeClasses[kClassTable.index[kMaxSmallSize / kQuantum]]
+              == kMaxSmallSize, "");
+
+size_t ClassIndex(size_t size) {
+    return kClassTable.index[(size + kQuantum - 1) / kQuantum];
+}
+
 Cache* CacheFor(size_t size) {
-    const size_t index = size / 128;
-    if (index >= sizeof(caches)/sizeof(caches[0])) {
+    if (size > kMaxSmallSize) {
         return nullptr;
     }
-    return &caches[index];
+    return &caches[ClassIndex(size)];
+}
+
+
+// Each CPU keeps short singly linked lists of free objects for the smallest
+// size classes, so that the most frequent allocations and frees don't touch
+// the slab caches at all. Lists are bounded by kBinSize and when a list
+// overflows or underflows half of kBinSize objects are moved to or from the
+// cache in bulk. Every kScavengePeriod operations objects that stayed unused
+// for the whole period are returned to the caches.
+//
+// Per CPU data must not be used from interrupt handlers, since nothing
+// prevents an interrupt from arriving in the middle of a list update.
+constexpr size_t kMaxCpus = 8;
+constexpr size_t kMaxCachedSize = 1024;
+constexpr size_t kCachedClasses =
+    kClassTable.index[kMaxCachedSize / kQuantum] + 1;
+constexpr size_t kBinSize = 32;
+constexpr size_t kScavengePeriod = static_cast<size_t>(1) << 16;
+
+struct FreeObject {
+    FreeObject* next;
+};
+
+struct Bin {
+    FreeObject* head;
+    size_t count;
+    // The smallest count since the last scavenge, objects below it weren't
+    // needed for the whole period.
+    size_t low;
+};
+
+struct CpuCache {
+    Bin bins[kCachedClasses];
+    size_t operations;
+};
+
+CpuCache cpu_caches[kMaxCpus];
+size_t cpus = 0;
+
+CpuCache* CurrentCpuCache() {
+    const uintptr_t tpidr = GetTpidrEl2();
+    if (tpidr != 0) {
+        return reinterpret_cast<CpuCache*>(tpidr);
+    }
+
+    size_t cpu = __atomic_load_n(&cpus, __ATOMIC_RELAXED);
+    do {
+        if (cpu == kMaxCpus) {
+            return nullptr;
+        }
+    } while (!__atomic_compare_exchange_n(
+            &cpus, &cpu, cpu + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    CpuCache* cache = &cpu_caches[cpu];
+    SetTpidrEl2(reinterpret_cast<uintptr_t>(cache));
+    return cache;
+}
+
+void Flush(Bin* bin, size_t index, size_t count) {
+    void* ptrs[kBinSize];
+    size_t flushed = 0;
+
+    while (flushed < count && bin->head != nullptr) {
+        FreeObject* object = bin->head;
+        bin->head = object->next;
+        ptrs[flushed++] = object;
+    }
+
+    bin->count -= flushed;
+    bin->low = std::min(bin->low, bin->count);
+    caches[index].FreeBulk(ptrs, flushed);
 }
 
-constexpr size_t MetadataSize() {
-    return common::AlignUp(sizeof(Metadata), kMaxAlignment);
+void Refill(Bin* bin, size_t index) {
+    void* ptrs[kBinSize / 2];
+    const size_t allocated = caches[index].AllocateBulk(ptrs, kBinSize / 2);
+
+    for (size_t i = 0; i < allocated; ++i) {
+        FreeObject* object = reinterpret_cast<FreeObject*>(ptrs[i]);
+        object->next = bin->head;
+        bin->head = object;
+    }
+    bin->count += allocated;
 }
 
-Metadata* MetadataFor(const void* ptr) {
-    return reinterpret_cast<Metadata*>(
-        reinterpret_cast<uintptr_t>(ptr) - MetadataSize());
+void Scavenge(CpuCache* cpu) {
+    for (size_t index = 0; index < kCachedClasses; ++index) {
+        Bin* bin = &cpu->bins[index];
+        Flush(bin, index, bin->low);
+        bin->low = bin->count;
+    }
 }
 
-}  // namespace
+void Tick(CpuCache* cpu) {
+    if (++cpu->operations % kScavengePeriod == 0) {
+        Scavenge(cpu);
+    }
+}
 
-void* Allocate(size_t size) {
-    const size_t allocation_size = size + MetadataSize();
+void* CpuAllocate(CpuCache* cpu, size_t index) {
+    Bin* bin = &cpu->bins[index];
 
-    Cache* cache = CacheFor(allocation_size);
-    if (cache != nullptr) {
-        void* ptr = cache->Allocate();
-        if (ptr == nullptr) {
+    if (bin->head == nullptr) {
+        Refill(bin, index);
+        if (bin->head == nullptr) {
             return nullptr;
         }
+    }
+
+    FreeObject* object = bin->head;
+    bin->head = object->next;
+    --bin->count;
+    bin->low = std::min(bin->low, bin->count);
+    Tick(cpu);
+    return object;
+}
+
+void CpuFree(CpuCache* cpu, size_t index, void* ptr) {
+    Bin* bin = &cpu->bins[index];
+
+    if (bin->count == kBinSize) {
+        Flush(bin, index, kBinSize / 2);
+    }
+
+    FreeObject* object = reinterpret_cast<FreeObject*>(ptr);
+    object->next = bin->head;
+    bin->head = object;
+    ++bin->count;
+    Tick(cpu);
+}
+
+void FreeSmall(void* ptr, size_t index) {
+    if (index < kCachedClasses) {
+        CpuCache* cpu = CurrentCpuCache();
+        if (cpu != nullptr) {
+            CpuFree(cpu, index, ptr);
+            return;
+        }
+    }
+    caches[index].Free(ptr);
+}
+
+// Every size class that is a multiple of a power of two alignment is aligned
+// at least as strictly (see the static_assert below), and blocks allocated
+// from the buddy allocator are aligned to their power of two size, so we
+// only need to round the size up to a multiple of the alignment.
+size_t AlignedSize(size_t size, size_t alignment) {
+    return common::AlignUp(std::max(size, alignment), alignment);
+}
+
+constexpr bool ClassesAligned() {
+    for (size_t alignment = 1; alignment <= kMaxSmallSize; alignment *= 2) {
+        for (size_t size = alignment; size <= kMaxSmallSize;
+                size += alignment) {
+            const size_t cls = kSizeClasses[kClassTable.index[
+                (size + kQuantum - 1) / kQuantum]];
+            if (cls % alignment != 0) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static_assert(ClassesAligned(),
+              "Size classes must preserve power of two alignment.");
 
-        Metadata* m = reinterpret_cast<Metadata*>(ptr);
-        m->cache = cache;
-        m->mem = Contigous(nullptr);
-        return reinterpret_cast<void*>(
-            reinterpret_cast<uintptr_t>(ptr) + MetadataSize());
+// Allocations don't carry any headers, instead we find the slab cache that
+// owns the pointer using the page descriptor. Pointers that don't belong to
+// any cache point to the first page of a Contigous allocation, so the size
+// of the allocation is known from the order of the first page.
+Page* PageFor(const void* ptr) {
+    return AddressPage(reinterpret_cast<uintptr_t>(ptr));
+}
+
+size_t AllocationSize(const Page* page) {
+    if (page->cache != nullptr) {
+        return page->cache->ObjectSize();
     }
+    return static_cast<size_t>(1) << (page->order + kPageBits);
+}
 
-    auto mem = AllocatePhysical(allocation_size);
+void* AllocateMemory(size_t size) {
+    if (size <= kMaxCachedSize) {
+        CpuCache* cpu = CurrentCpuCache();
+        if (cpu != nullptr) {
+            return CpuAllocate(cpu, ClassIndex(size));
+        }
+    }
+
+    Cache* cache = CacheFor(size);
+    if (cache != nullptr) {
+        return cache->Allocate();
+    }
+
+    auto mem = AllocatePhysical(size);
     if (mem) {
-        Metadata* m = reinterpret_cast<Metadata*>(mem->FromAddress());
-        m->cache = nullptr;
-        m->mem = *mem;
-        return reinterpret_cast<void*>(mem->FromAddress() + MetadataSize());
+        return reinterpret_cast<void*>(mem->FromAddress());
     }
 
     return nullptr;
 }
 
+}  // namespace
+
+void* Allocate(size_t size) {
+    void* ptr = AllocateMemory(size);
+    if (impl::heap_profile_running && ptr != nullptr) {
+        impl::SampleAllocation(
+            ptr, size, __builtin_return_address(0), __builtin_frame_address(0));
+    }
+    return ptr;
+}
+
 void* Reallocate(void* ptr, size_t new_size) {
-    Metadata* m = MetadataFor(ptr);
-    size_t old_size = 0;
+    if (ptr == nullptr) {
+        return Allocate(new_size);
+    }
+
+    const Page* page = PageFor(ptr);
+    const size_t old_size = AllocationSize(page);
 
-    if (m->cache != nullptr) {
-        Cache* cache = m->cache;
-        if (cache->ObjectSize() >= new_size) {
+    // Blocks that don't belong to a slab cache can be resized in place by
+    // the buddy allocator, as long as they stay too large for the caches.
+    if (page->cache == nullptr && new_size > kMaxSmallSize) {
+        const uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+        if (ResizePhysical(addr, new_size)) {
+            if (impl::heap_profile_samples != 0) {
+                impl::SampleResize(ptr, new_size);
+            }
             return ptr;
         }
-        old_size = cache->ObjectSize() - MetadataSize();
     }
 
-    if (m->mem != Contigous(nullptr)) {
-        if (m->mem.Size() >= new_size) {
-            return ptr;
+    if (old_size >= new_size) {
+        if (impl::heap_profile_samples != 0) {
+            impl::SampleResize(ptr, new_size);
         }
-        old_size = m->mem.Size() - MetadataSize();
+        return ptr;
     }
 
     void* new_ptr = Allocate(new_size);
@@ -128,15 +347,72 @@ void* Reallocate(void* ptr, size_t new_size) {
 }
 
 void Free(void* ptr) {
-    Metadata* m = MetadataFor(ptr);
+    if (ptr == nullptr) {
+        return;
+    }
 
-    if (m->cache != nullptr) {
-        Cache* cache = m->cache;
-        cache->Free(reinterpret_cast<void*>(m));
+    if (impl::heap_profile_samples != 0) {
+        impl::SampleFree(ptr);
+    }
+
+    // The page points to the cache that owns the slab, which might be
+    // different from the size class cache if the latter was merged with
+    // another cache, so we go through the size class in both cases.
+    Page* page = PageFor(ptr);
+    if (page->cache != nullptr) {
+        FreeSmall(ptr, ClassIndex(page->cache->ObjectSize()));
+        return;
+    }
+
+    FreePhysical(reinterpret_cast<uintptr_t>(ptr));
+}
+
+void Free(void* ptr, size_t size) {
+    if (ptr == nullptr) {
         return;
     }
 
-    FreePhysical(m->mem);
+    if (impl::heap_profile_samples != 0) {
+        impl::SampleFree(ptr);
+    }
+
+    if (size <= kMaxSmallSize) {
+        FreeSmall(ptr, ClassIndex(size));
+        return;
+    }
+
+    FreePhysical(reinterpret_cast<uintptr_t>(ptr));
+}
+
+void FlushCpuCache() {
+    CpuCache* cpu = CurrentCpuCache();
+    if (cpu == nullptr) {
+        return;
+    }
+
+    for (size_t index = 0; index < kCachedClasses; ++index) {
+        Bin* bin = &cpu->bins[index];
+        while (bin->count != 0) {
+            Flush(bin, index, kBinSize);
+        }
+        bin->low = 0;
+    }
+}
+
+void* AllocateAligned(size_t size, size_t alignment) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        return nullptr;
+    }
+    // The Rust runtime passes arbitrary layouts through the C ABI, rounding
+    // sizes this large up to the alignment would wrap around.
+    if (size > ~static_cast<size_t>(0) - alignment) {
+        return nullptr;
+    }
+    return Allocate(AlignedSize(size, alignment));
+}
+
+void FreeAligned(void* ptr, size_t size, size_t alignment) {
+    Free(ptr, AlignedSize(size, alignment));
 }
 
 }  // namespace memory
@@ -6,9 +6,26 @@
 namespace memory {
 
 void* Allocate(size_t size);
+// Like realloc, Reallocate of nullptr is the same as Allocate.
 void* Reallocate(void* ptr, size_t new_size);
 void Free(void* ptr);
 
+// Size must be the same as the size passed to Allocate, knowing the size
+// allows to find the owning cache without looking at the page descriptor.
+void Free(void* ptr, size_t size);
+
+// Alignment must be a power of two, but otherwise isn't limited: small
+// allocations come from a size class aligned at least as strictly as
+// requested, larger ones from the buddy allocator that aligns them to the
+// size. FreeAligned must be called with the same size and alignment.
+// AllocateAligned returns nullptr if the size rounded up to the alignment
+// doesn't fit in size_t.
+void* AllocateAligned(size_t size, size_t alignment);
+void FreeAligned(void* ptr, size_t size, size_t alignment);
+
+// Returns all objects cached by the current CPU to the slab caches.
+void FlushCpuCache();
+
 }  // namespace memory
 
 #endif  // __MEMORY_ALLOC_H__
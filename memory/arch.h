@@ -25,6 +25,123 @@ inline uintptr_t GetTtbar0El2() {
     return ttbr;
 }
 
+inline void SetTcrEl2(uint64_t tcr) {
+    asm volatile("msr TCR_EL2, %0" : : "r"(tcr));
+}
+
+inline uint64_t GetTcrEl2() {
+    uint64_t tcr;
+    asm volatile("mrs %0, TCR_EL2" : "=r"(tcr));
+    return tcr;
+}
+
+inline void SetSctlrEl2(uint64_t sctlr) {
+    asm volatile("msr SCTLR_EL2, %0" : : "r"(sctlr) : "memory");
+}
+
+inline uint64_t GetSctlrEl2() {
+    uint64_t sctlr;
+    asm volatile("mrs %0, SCTLR_EL2" : "=r"(sctlr));
+    return sctlr;
+}
+
+inline uint64_t GetIdAa64Mmfr0El1() {
+    uint64_t mmfr0;
+    asm volatile("mrs %0, ID_AA64MMFR0_EL1" : "=r"(mmfr0));
+    return mmfr0;
+}
+
+inline uint64_t GetIdAa64Mmfr2El1() {
+    uint64_t mmfr2;
+    asm volatile("mrs %0, ID_AA64MMFR2_EL1" : "=r"(mmfr2));
+    return mmfr2;
+}
+
+inline uint64_t GetIdAa64Isar0El1() {
+    uint64_t isar0;
+    asm volatile("mrs %0, ID_AA64ISAR0_EL1" : "=r"(isar0));
+    return isar0;
+}
+
+inline uint64_t GetClidrEl1() {
+    uint64_t clidr;
+    asm volatile("mrs %0, CLIDR_EL1" : "=r"(clidr));
+    return clidr;
+}
+
+inline void SetCsselrEl1(uint64_t csselr) {
+    asm volatile("msr CSSELR_EL1, %0" : : "r"(csselr));
+}
+
+inline uint64_t GetCcsidrEl1() {
+    uint64_t ccsidr;
+    asm volatile("mrs %0, CCSIDR_EL1" : "=r"(ccsidr));
+    return ccsidr;
+}
+
+// Invalidates a data cache line by set/way without writing it back.
+inline void DcIsw(uint64_t setway) {
+    asm volatile("dc isw, %0" : : "r"(setway) : "memory");
+}
+
+inline void IcIallu() {
+    asm volatile("ic iallu" : : : "memory");
+}
+
+inline void DsbIshSt() {
+    asm volatile("dsb ishst" : : : "memory");
+}
+
+inline void DsbIsh() {
+    asm volatile("dsb ish" : : : "memory");
+}
+
+inline void Isb() {
+    asm volatile("isb" : : : "memory");
+}
+
+// Invalidates all the EL2 TLB entries on all the CPUs in the inner shareable
+// domain, the caller is responsible for the barriers.
+inline void TlbiAllE2Is() {
+    asm volatile("tlbi alle2is" : : : "memory");
+}
+
+// Invalidates the EL2 TLB entries for the virtual address on all the CPUs in
+// the inner shareable domain. The operand contains the page number of the
+// address.
+inline void TlbiVae2Is(uint64_t operand) {
+    asm volatile("tlbi vae2is, %0" : : "r"(operand) : "memory");
+}
+
+// TLBI RVAE2IS from FEAT_TLBIRANGE, it's encoded as a SYS instruction, so
+// that the assembler doesn't need to know about the extension.
+inline void TlbiRvae2Is(uint64_t operand) {
+    asm volatile("sys #4, c8, c2, #1, %0" : : "r"(operand) : "memory");
+}
+
+// A hint for the CPU that we are spinning on a lock.
+inline void Yield() {
+    asm volatile("yield" ::: "memory");
+}
+
+inline uint64_t GetMpidrEl1() {
+    uint64_t mpidr;
+    asm volatile("mrs %0, MPIDR_EL1" : "=r"(mpidr));
+    return mpidr;
+}
+
+// TPIDR_EL2 points to the per CPU allocator state, boot code clears it
+// before any allocation happens.
+inline uintptr_t GetTpidrEl2() {
+    uintptr_t tpidr;
+    asm volatile("mrs %0, TPIDR_EL2" : "=r"(tpidr));
+    return tpidr;
+}
+
+inline void SetTpidrEl2(uintptr_t tpidr) {
+    asm volatile("msr TPIDR_EL2, %0" : : "r"(tpidr));
+}
+
 }  // namespace memory
 
 #endif  // __MEMORY_ARCH_H__
@@ -5,7 +5,9 @@
 #include <utility>
 #include <algorithm>
 
+#include "common/logging.h"
 #include "common/math.h"
+#include "arch.h"
 
 namespace memory {
 
@@ -13,59 +15,84 @@ namespace impl {
 
 namespace {
 
-size_t ObjectSize(size_t size, size_t alignment) {
-    return common::AlignUp(std::max(size, sizeof(Storage)), alignment);
+[[ noreturn ]] void Panic() {
+    while (1) {
+        asm volatile("":::"memory");
+    }
 }
 
-size_t SlabSize(size_t size, size_t control) {
-    constexpr size_t kMinObjects = 32;
-    constexpr size_t kMinSize = 4096;
+uint64_t CurrentCpu() {
+    // Affinity levels 0-3 together uniquely identify the CPU.
+    constexpr uint64_t kAffinityMask = 0xff00ffffffull;
+    return GetMpidrEl1() & kAffinityMask;
+}
 
-    const size_t min_bytes = size * kMinObjects + control;
+// CPUs get their indices in the order they first use a cache. The slot of
+// a CPU keeps its affinity plus one, so that zero marks a free slot.
+uint64_t cpus[kMaxCpus];
 
-    if (kMinSize >= min_bytes) {
-        return kMinSize;
-    }
+size_t CpuIndex() {
+    const uint64_t id = CurrentCpu() + 1;
 
-    const size_t order =  common::MostSignificantBit(min_bytes - 1) + 1;
-    return static_cast<size_t>(1) << order;
+    for (size_t i = 0; i < kMaxCpus; ++i) {
+        uint64_t slot = __atomic_load_n(&cpus[i], __ATOMIC_RELAXED);
+        if (slot == 0 && __atomic_compare_exchange_n(
+                &cpus[i], &slot, id,
+                /* weak = */false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            return i;
+        }
+        if (slot == id) {
+            return i;
+        }
+    }
+    Panic();
 }
 
-Layout MakeLayout(size_t size, size_t alignment) {
-    const size_t control_size = sizeof(Slab);
-    const size_t object_size = ObjectSize(size, alignment);
-    const size_t slab_size = SlabSize(object_size, control_size);
+constexpr size_t kDrainBatch = 64;
 
-    Layout layout;
-    layout.object_size = object_size;
-    layout.object_offset = 0;
-    layout.objects = (slab_size - control_size) / object_size;
-    layout.control_offset = slab_size - control_size;
-    layout.slab_size = slab_size;
-    return layout;
-}
+// Caches may start allocating on several CPUs at once, so the registry is
+// protected by a spinlock.
+common::IntrusiveList<Cache> registry;
+bool registry_lock = false;
+bool merging = true;
 
-[[ noreturn ]] void Panic() {
-    while (1) {
-        asm volatile("":::"memory");
+void LockRegistry() {
+    while (__atomic_test_and_set(&registry_lock, __ATOMIC_ACQUIRE)) {
+        Yield();
     }
 }
 
+void UnlockRegistry() {
+    __atomic_clear(&registry_lock, __ATOMIC_RELEASE);
+}
+
 }  // namespace
 
 
-Storage::Storage(void* ptr) : pointer(ptr) {}
+bool operator==(const Layout& l, const Layout& r) {
+    return l.object_size == r.object_size
+        && l.object_offset == r.object_offset
+        && l.storage_offset == r.storage_offset
+        && l.objects == r.objects
+        && l.control_offset == r.control_offset
+        && l.slab_size == r.slab_size;
+}
+
+bool operator!=(const Layout& l, const Layout& r) {
+    return !(l == r);
+}
+
 
-Slab::Slab(const Cache* cache, Contigous mem, Layout layout)
-        : cache_(cache), memory_(mem) {
-    const uintptr_t from = memory_.FromAddress() + layout.object_offset;
+Slab::Slab(const Cache* cache, size_t cpu, Contigous mem, Layout layout)
+        : storage_offset_(layout.storage_offset), cache_(cache), cpu_(cpu),
+          memory_(mem), from_(mem.FromAddress()), to_(mem.ToAddress()) {
+    const uintptr_t from = from_ + layout.object_offset;
     const uintptr_t to = from + layout.object_size * layout.objects;
 
-    for (uintptr_t addr = from; addr < to; addr += layout.object_size) {
-        void* ptr = reinterpret_cast<void*>(addr);
-        Storage* storage = reinterpret_cast<Storage*>(ptr);
-        ::new (storage) Storage(ptr);
-        freelist_.PushBack(storage);
+    // Push objects in the reverse order, so that they are handed out in
+    // the address order.
+    for (uintptr_t addr = to; addr > from; addr -= layout.object_size) {
+        Push(reinterpret_cast<void*>(addr - layout.object_size));
     }
 }
 
@@ -78,134 +105,410 @@ Slab::~Slab() {
 
 const Cache* Slab::Owner() const { return cache_; }
 
+void Slab::SetOwner(const Cache* cache) { cache_ = cache; }
+
+size_t Slab::Cpu() const { return cpu_; }
+
 Contigous Slab::Memory() const { return memory_; }
 
 size_t Slab::Allocated() const { return allocated_; }
 
-bool Slab::Empty() const { return freelist_.Empty(); }
+bool Slab::Empty() const { return freelist_ == nullptr; }
 
-void* Slab::Allocate() {
-    Storage* storage = freelist_.PopFront();
+bool Slab::Contains(uintptr_t addr) const {
+    return addr >= from_ && addr < to_;
+}
+
+Storage* Slab::StorageFor(void* ptr) const {
+    return reinterpret_cast<Storage*>(
+        reinterpret_cast<uintptr_t>(ptr) + storage_offset_);
+}
+
+void* Slab::ObjectFor(Storage* storage) const {
+    return reinterpret_cast<void*>(
+        reinterpret_cast<uintptr_t>(storage) - storage_offset_);
+}
+
+void Slab::Push(void* ptr) {
+    Storage* storage = StorageFor(ptr);
+    storage->next = freelist_;
+    freelist_ = storage;
+}
+
+void* Slab::Pop() {
+    Storage* storage = freelist_;
     if (storage == nullptr) {
         return nullptr;
     }
+    freelist_ = storage->next;
+    return ObjectFor(storage);
+}
 
-    void* ptr = storage->pointer;
-    storage->~Storage();
+void* Slab::Allocate() {
+    void* ptr = Pop();
+    if (ptr == nullptr) {
+        return nullptr;
+    }
     ++allocated_;
     return ptr;
 }
 
+size_t Slab::Allocate(void** ptrs, size_t count) {
+    size_t allocated = 0;
+
+    while (allocated < count) {
+        void* ptr = Pop();
+        if (ptr == nullptr) {
+            break;
+        }
+        ptrs[allocated++] = ptr;
+    }
+
+    allocated_ += allocated;
+    return allocated;
+}
+
 bool Slab::Free(void* ptr) {
-    const uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
-    if (addr < memory_.FromAddress() || addr >= memory_.ToAddress()) {
+    if (!Contains(reinterpret_cast<uintptr_t>(ptr))) {
         return false;
     }
-    Storage* storage = reinterpret_cast<Storage*>(ptr);
-    ::new (storage) Storage(ptr);
-    freelist_.PushFront(storage);
+    Push(ptr);
     --allocated_;
     return true;
 }
 
+size_t Slab::Free(void** ptrs, size_t count) {
+    size_t freed = 0;
 
-Allocator::Allocator(struct Layout layout) : allocated_(0), layout_(layout) {}
+    for (size_t i = 0; i < count && freed < allocated_; ++i) {
+        if (!Contains(reinterpret_cast<uintptr_t>(ptrs[i]))) {
+            continue;
+        }
+        Push(ptrs[i]);
+        ++freed;
+    }
 
-Slab* Allocator::Allocate(const Cache* cache) {
+    allocated_ -= freed;
+    return freed;
+}
+
+
+// Every CPU allocates slabs for its own use, so allocated_ is the only
+// field of the allocator updated by several CPUs.
+Slab* Allocator::Allocate(Cache* cache, size_t cpu) {
     auto mem = AllocatePhysical(layout_.slab_size);
     if (!mem) {
         return nullptr;
     }
     Slab* slab = reinterpret_cast<Slab*>(
             mem->FromAddress() + layout_.control_offset);
-    ::new (slab) Slab(cache, *mem, layout_);
-    allocated_ += layout_.slab_size;
+    ::new (slab) Slab(cache, cpu, *mem, layout_);
+    __atomic_fetch_add(&allocated_, layout_.slab_size, __ATOMIC_RELAXED);
+    SetOwner(*mem, cache);
+
+    if (ctor_ != nullptr) {
+        const uintptr_t from = mem->FromAddress() + layout_.object_offset;
+        const uintptr_t to = from + layout_.object_size * layout_.objects;
+
+        for (uintptr_t addr = from; addr < to; addr += layout_.object_size) {
+            ctor_(reinterpret_cast<void*>(addr));
+        }
+    }
     return slab;
 }
 
 void Allocator::Free(Slab* slab) {
     Contigous mem = slab->Memory();
     slab->~Slab();
-    allocated_ -= layout_.slab_size;
+
+    if (dtor_ != nullptr) {
+        const uintptr_t from = mem.FromAddress() + layout_.object_offset;
+        const uintptr_t to = from + layout_.object_size * layout_.objects;
+
+        for (uintptr_t addr = from; addr < to; addr += layout_.object_size) {
+            dtor_(reinterpret_cast<void*>(addr));
+        }
+    }
+    __atomic_fetch_sub(&allocated_, layout_.slab_size, __ATOMIC_RELAXED);
+    SetOwner(mem, nullptr);
     FreePhysical(mem);
 }
 
+void Allocator::Adopt(Slab* slab, Allocator* from, Cache* cache) {
+    __atomic_fetch_sub(&from->allocated_, layout_.slab_size, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&allocated_, layout_.slab_size, __ATOMIC_RELAXED);
+    slab->SetOwner(cache);
+    SetOwner(slab->Memory(), cache);
+}
+
+void Allocator::SetOwner(Contigous mem, Cache* cache) {
+    Page* pages = mem.Pages();
+    const size_t count = static_cast<size_t>(1) << mem.Order();
+
+    for (size_t i = 0; i < count; ++i) {
+        pages[i].cache = cache;
+    }
+}
+
 Slab* Allocator::Find(void* ptr) {
     const uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
     const uintptr_t head = common::AlignDown(
         addr, static_cast<uintptr_t>(layout_.slab_size));
     Slab* slab = reinterpret_cast<Slab*>(head + layout_.control_offset);
-    Contigous memory = slab->Memory();
-    if (addr < memory.FromAddress() || addr >= memory.ToAddress()) {
+    if (!slab->Contains(addr)) {
         return nullptr;
     }
     return slab;
 }
 
-uintptr_t Allocator::Allocated() const { return allocated_; }
+void Allocator::Prefetch(const void* ptr) const {
+    const uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+    const uintptr_t head = common::AlignDown(
+        addr, static_cast<uintptr_t>(layout_.slab_size));
+    __builtin_prefetch(
+        reinterpret_cast<const void*>(head + layout_.control_offset), 1);
+    __builtin_prefetch(ptr, 1);
+}
+
+bool Allocator::Constructs() const {
+    return ctor_ != nullptr || dtor_ != nullptr;
+}
+
+uintptr_t Allocator::Allocated() const {
+    return __atomic_load_n(&allocated_, __ATOMIC_RELAXED);
+}
 
 Layout Allocator::Layout() const { return layout_; }
 
 }  // namespace impl
 
 
-Cache::Cache(size_t size, size_t alignment)
-    : layout_(impl::MakeLayout(size, alignment))
-    , allocator_(layout_)
-{}
-
 Cache::~Cache() {
-    if (!partial_.Empty() || !full_.Empty()) {
+    for (size_t cpu = 0; cpu < impl::kMaxCpus; ++cpu) {
+        DrainRemote(cpu);
+    }
+    // The objects of the aliases may outlive the cache, see Handover, but
+    // the objects allocated through the cache itself must not.
+    if (Allocated() != 0) {
         impl::Panic();
     }
-    Reclaim();
+    Unregister();
+    for (size_t cpu = 0; cpu < impl::kMaxCpus; ++cpu) {
+        for (size_t i = 0; i < kPartialLists; ++i) {
+            if (!slabs_[cpu].partial[i].Empty()) {
+                impl::Panic();
+            }
+        }
+        if (!slabs_[cpu].full.Empty()) {
+            impl::Panic();
+        }
+        ReclaimOn(cpu);
+    }
 }
 
-size_t Cache::Allocated() const { return allocated_; }
+const char* Cache::Name() const { return name_; }
+
+size_t Cache::Allocated() const {
+    uintptr_t allocated = 0;
+    for (size_t cpu = 0; cpu < impl::kMaxCpus; ++cpu) {
+        allocated += slabs_[cpu].allocated;
+    }
+    return allocated;
+}
 
-size_t Cache::Occupied() const { return allocator_.Allocated(); }
+size_t Cache::Occupied() const {
+    if (alias_ != nullptr) {
+        return alias_->Occupied();
+    }
+    return allocator_.Allocated();
+}
 
-size_t Cache::Reclaimable() const { return reclaimable_; }
+size_t Cache::Reclaimable() const {
+    if (alias_ != nullptr) {
+        return alias_->Reclaimable();
+    }
+
+    uintptr_t reclaimable = 0;
+    for (size_t cpu = 0; cpu < impl::kMaxCpus; ++cpu) {
+        reclaimable += slabs_[cpu].reclaimable;
+    }
+    return reclaimable;
+}
 
 size_t Cache::ObjectSize() const { return layout_.object_size; }
 
+size_t Cache::ObjectsPerSlab() const { return layout_.objects; }
+
+void Cache::Dump() {
+    const size_t allocations = Allocations();
+    const size_t frees = Frees();
+
+    if (alias_ != nullptr) {
+        common::Log() << Name()
+              << " merged into " << alias_->Name()
+              << ", active objects " << Allocated() / ObjectSize()
+              << ", allocations " << allocations - dumped_allocations_
+              << ", frees " << frees - dumped_frees_ << "\n";
+        dumped_allocations_ = allocations;
+        dumped_frees_ = frees;
+        return;
+    }
+
+    common::Log() << Name()
+          << " object size " << ObjectSize()
+          << ", objects per slab " << ObjectsPerSlab()
+          << ", active objects " << Allocated() / ObjectSize()
+          << ", occupied " << Occupied()
+          << ", reclaimable " << Reclaimable()
+          << ", waste " << Occupied() - Used()
+          << ", allocations " << allocations - dumped_allocations_
+          << ", frees " << frees - dumped_frees_ << "\n";
+    dumped_allocations_ = allocations;
+    dumped_frees_ = frees;
+}
+
 bool Cache::Reclaim() {
-    bool ret = Reclaimable() != 0;
-    for (impl::Slab* slab = free_.PopFront();
+    if (alias_ != nullptr) {
+        return alias_->Reclaim();
+    }
+    return ReclaimOn(impl::CpuIndex());
+}
+
+bool Cache::ReclaimOn(size_t cpu) {
+    CpuSlabs* slabs = &slabs_[cpu];
+
+    DrainRemote(cpu);
+    bool ret = slabs->reclaimable != 0;
+    for (impl::Slab* slab = slabs->free.PopFront();
          slab != nullptr;
-         slab = free_.PopFront()) {
+         slab = slabs->free.PopFront()) {
         allocator_.Free(slab);
     }
-    reclaimable_ = 0;
+    slabs->reclaimable = 0;
     return ret;
 }
 
-void* Cache::Allocate() {
-    if (!partial_.Empty()) {
-        impl::Slab* slab = partial_.Front();
-        if (slab->Allocated() + 1 == layout_.objects) {
-            partial_.Unlink(slab);
-            full_.PushFront(slab);
+Cache::SlabList* Cache::ListFor(const impl::Slab* slab) {
+    CpuSlabs* slabs = &slabs_[slab->Cpu()];
+
+    if (slab->Allocated() == 0) {
+        return &slabs->free;
+    }
+    if (slab->Empty()) {
+        return &slabs->full;
+    }
+    const size_t list = slab->Allocated() * kPartialLists / layout_.objects;
+    return &slabs->partial[list];
+}
+
+void Cache::Relink(impl::Slab* slab, SlabList* from) {
+    SlabList* to = ListFor(slab);
+    if (from == to) {
+        return;
+    }
+
+    from->Unlink(slab);
+    to->PushFront(slab);
+
+    CpuSlabs* slabs = &slabs_[slab->Cpu()];
+    if (from == &slabs->free) {
+        slabs->reclaimable -= layout_.slab_size;
+    }
+    if (to == &slabs->free) {
+        slabs->reclaimable += layout_.slab_size;
+    }
+}
+
+impl::Slab* Cache::FullestSlab(size_t cpu) {
+    SlabList* partial = slabs_[cpu].partial;
+
+    for (size_t i = kPartialLists; i != 0; --i) {
+        if (!partial[i - 1].Empty()) {
+            return partial[i - 1].Front();
+        }
+    }
+    return nullptr;
+}
+
+impl::Slab* Cache::PartialSlab(size_t cpu) {
+    impl::Slab* slab = FullestSlab(cpu);
+    if (slab != nullptr) {
+        return slab;
+    }
+
+    if (DrainRemote(cpu)) {
+        slab = FullestSlab(cpu);
+        if (slab != nullptr) {
+            return slab;
         }
-        allocated_ += layout_.object_size;
-        return slab->Allocate();
     }
 
-    if (!free_.Empty()) {
-        impl::Slab* slab = free_.PopFront();
-        partial_.PushFront(slab);
-        allocated_ += layout_.object_size;
-        reclaimable_ -= layout_.slab_size;
-        return slab->Allocate();
+    CpuSlabs* slabs = &slabs_[cpu];
+    if (!slabs->free.Empty()) {
+        return slabs->free.Front();
+    }
+
+    slab = allocator_.Allocate(this, cpu);
+    if (slab == nullptr) {
+        return nullptr;
+    }
+    slabs->free.PushFront(slab);
+    slabs->reclaimable += layout_.slab_size;
+    return slab;
+}
+
+// The public functions account the objects on the calling CPU, the rest only
+// manage the slabs. Aliases call the slab functions of the merge target
+// directly, so every object is only counted by the cache it was allocated
+// through.
+void* Cache::Allocate() {
+    Register();
+
+    const size_t cpu = impl::CpuIndex();
+    void* ptr = Target()->AllocateOn(cpu);
+    if (ptr != nullptr) {
+        AccountAllocations(cpu, 1);
     }
+    return ptr;
+}
 
-    impl::Slab* slab = allocator_.Allocate(this);
+void* Cache::AllocateOn(size_t cpu) {
+    impl::Slab* slab = PartialSlab(cpu);
     if (slab == nullptr) {
         return nullptr;
     }
-    partial_.PushFront(slab);
-    allocated_ += layout_.object_size;
-    return slab->Allocate();
+
+    SlabList* list = ListFor(slab);
+    void* ptr = slab->Allocate();
+    Relink(slab, list);
+    slabs_[cpu].used += layout_.object_size;
+    return ptr;
+}
+
+size_t Cache::AllocateBulk(void** ptrs, size_t count) {
+    Register();
+
+    const size_t cpu = impl::CpuIndex();
+    const size_t allocated = Target()->AllocateBulkOn(cpu, ptrs, count);
+    AccountAllocations(cpu, allocated);
+    return allocated;
+}
+
+size_t Cache::AllocateBulkOn(size_t cpu, void** ptrs, size_t count) {
+    size_t allocated = 0;
+
+    while (allocated < count) {
+        impl::Slab* slab = PartialSlab(cpu);
+        if (slab == nullptr) {
+            break;
+        }
+
+        SlabList* list = ListFor(slab);
+        allocated += slab->Allocate(ptrs + allocated, count - allocated);
+        Relink(slab, list);
+    }
+    slabs_[cpu].used += allocated * layout_.object_size;
+    return allocated;
 }
 
 bool Cache::Free(void* ptr) {
@@ -213,11 +516,28 @@ bool Cache::Free(void* ptr) {
         return false;
     }
 
+    const size_t cpu = impl::CpuIndex();
+    if (Target()->FreeOn(cpu, ptr)) {
+        AccountFrees(cpu, 1);
+        return true;
+    }
+    return false;
+}
+
+bool Cache::FreeOn(size_t cpu, void* ptr) {
     impl::Slab* slab = allocator_.Find(ptr);
     if (slab == nullptr) {
         return false;
     }
 
+    if (slab->Cpu() != cpu) {
+        FreeRemote(slab, &ptr, 1);
+        return true;
+    }
+    return FreeSlabObject(slab, ptr);
+}
+
+bool Cache::FreeSlabObject(impl::Slab* slab, void* ptr) {
     if (slab->Owner() != this) {
         impl::Panic();
     }
@@ -226,23 +546,299 @@ bool Cache::Free(void* ptr) {
         return false;
     }
 
+    SlabList* list = ListFor(slab);
     if (!slab->Free(ptr)) {
         return false;
     }
+    Relink(slab, list);
+    slabs_[slab->Cpu()].used -= layout_.object_size;
+    return true;
+}
 
-    if (slab->Allocated() == 0) {
-        partial_.Unlink(slab);
-        free_.PushFront(slab);
-        reclaimable_ += layout_.slab_size;
+size_t Cache::FreeSlabObjects(impl::Slab* slab, void** ptrs, size_t count) {
+    if (slab->Owner() != this) {
+        impl::Panic();
     }
 
-    if (slab->Allocated() + 1 == layout_.objects) {
-        full_.Unlink(slab);
-        partial_.PushFront(slab);
+    SlabList* list = ListFor(slab);
+    const size_t freed = slab->Free(ptrs, count);
+    Relink(slab, list);
+    slabs_[slab->Cpu()].used -= freed * layout_.object_size;
+    return freed;
+}
+
+size_t Cache::FreeBulk(void** ptrs, size_t count) {
+    const size_t cpu = impl::CpuIndex();
+    const size_t freed = Target()->FreeBulkOn(cpu, ptrs, count);
+    AccountFrees(cpu, freed);
+    return freed;
+}
+
+// Walks the pointers in order and frees every run of pointers to the same
+// slab at once, so every slab is looked up once per run and the whole bulk
+// free is linear. Grouping the pointers by slab first, by sorting or with a
+// hash table, costs more than it saves. Objects scattered over many slabs
+// make every free a cache miss, so the slabs and the objects a few pointers
+// ahead are prefetched, otherwise FreeBulk is slower than separate Free calls.
+size_t Cache::FreeBulkOn(size_t cpu, void** ptrs, size_t count) {
+    constexpr size_t kPrefetchDistance = 8;
+    size_t freed = 0;
+    impl::Slab* slab = nullptr;
+    size_t run = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        if (i + kPrefetchDistance < count
+                && ptrs[i + kPrefetchDistance] != nullptr) {
+            allocator_.Prefetch(ptrs[i + kPrefetchDistance]);
+        }
+
+        if (slab != nullptr
+                && slab->Contains(reinterpret_cast<uintptr_t>(ptrs[i]))) {
+            continue;
+        }
+
+        if (slab != nullptr) {
+            freed += FreeRun(cpu, slab, ptrs + run, i - run);
+        }
+        slab = ptrs[i] != nullptr ? allocator_.Find(ptrs[i]) : nullptr;
+        run = i;
     }
 
-    allocated_ -= layout_.object_size;
+    if (slab != nullptr) {
+        freed += FreeRun(cpu, slab, ptrs + run, count - run);
+    }
+    return freed;
+}
+
+size_t Cache::FreeRun(
+        size_t cpu, impl::Slab* slab, void** ptrs, size_t count) {
+    if (slab->Cpu() != cpu) {
+        FreeRemote(slab, ptrs, count);
+        return count;
+    }
+    if (count == 1) {
+        return FreeSlabObject(slab, ptrs[0]) ? 1 : 0;
+    }
+    return FreeSlabObjects(slab, ptrs, count);
+}
+
+// Links the objects together first, so that the whole run is pushed to the
+// remote free list of the slab's CPU at once.
+void Cache::FreeRemote(impl::Slab* slab, void** ptrs, size_t count) {
+    if (slab->Owner() != this) {
+        impl::Panic();
+    }
+
+    impl::RemoteStorage* first = nullptr;
+    impl::RemoteStorage* last = nullptr;
+    for (size_t i = count; i != 0; --i) {
+        impl::RemoteStorage* storage = reinterpret_cast<impl::RemoteStorage*>(
+            reinterpret_cast<uintptr_t>(ptrs[i - 1]) + layout_.storage_offset);
+        storage->next = first;
+        first = storage;
+        if (last == nullptr) {
+            last = storage;
+        }
+    }
+
+    CpuSlabs* slabs = &slabs_[slab->Cpu()];
+    impl::RemoteStorage* head =
+        __atomic_load_n(&slabs->remote, __ATOMIC_RELAXED);
+
+    do {
+        last->next = head;
+    } while (!__atomic_compare_exchange_n(
+        &slabs->remote, &head, first,
+        /* weak = */true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+bool Cache::DrainRemote(size_t cpu) {
+    CpuSlabs* slabs = &slabs_[cpu];
+    if (__atomic_load_n(&slabs->remote, __ATOMIC_RELAXED) == nullptr) {
+        return false;
+    }
+
+    // The owner takes the whole list at once, so unlike a general lock-free
+    // stack pop we don't have to worry about ABA here.
+    impl::RemoteStorage* storage = __atomic_exchange_n(
+        &slabs->remote, nullptr, __ATOMIC_ACQUIRE);
+    void* batch[impl::kDrainBatch];
+    size_t count = 0;
+
+    while (storage != nullptr) {
+        impl::RemoteStorage* next = storage->next;
+        batch[count++] = reinterpret_cast<void*>(
+            reinterpret_cast<uintptr_t>(storage) - layout_.storage_offset);
+        if (count == impl::kDrainBatch) {
+            FreeBulkOn(cpu, batch, count);
+            count = 0;
+        }
+        storage = next;
+    }
+    FreeBulkOn(cpu, batch, count);
     return true;
 }
 
+Cache* Cache::Target() {
+    return alias_ != nullptr ? alias_ : this;
+}
+
+void Cache::AccountAllocations(size_t cpu, size_t objects) {
+    slabs_[cpu].allocated += objects * layout_.object_size;
+    slabs_[cpu].allocations += objects;
+}
+
+void Cache::AccountFrees(size_t cpu, size_t objects) {
+    slabs_[cpu].allocated -= objects * layout_.object_size;
+    slabs_[cpu].frees += objects;
+}
+
+size_t Cache::Allocations() const {
+    size_t allocations = 0;
+    for (size_t cpu = 0; cpu < impl::kMaxCpus; ++cpu) {
+        allocations += slabs_[cpu].allocations;
+    }
+    return allocations;
+}
+
+size_t Cache::Frees() const {
+    size_t frees = 0;
+    for (size_t cpu = 0; cpu < impl::kMaxCpus; ++cpu) {
+        frees += slabs_[cpu].frees;
+    }
+    return frees;
+}
+
+size_t Cache::Used() const {
+    uintptr_t used = 0;
+    for (size_t cpu = 0; cpu < impl::kMaxCpus; ++cpu) {
+        used += slabs_[cpu].used;
+    }
+    return used;
+}
+
+void Cache::Register() {
+    if (__atomic_load_n(&registered_, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    impl::LockRegistry();
+    if (!registered_) {
+        if (impl::merging) {
+            alias_ = FindMergeTarget();
+        }
+        if (alias_ != nullptr) {
+            ++alias_->aliases_;
+        }
+        impl::registry.PushBack(this);
+        __atomic_store_n(&registered_, true, __ATOMIC_RELEASE);
+    }
+    impl::UnlockRegistry();
+}
+
+void Cache::Unregister() {
+    if (!registered_) {
+        return;
+    }
+
+    impl::LockRegistry();
+    if (alias_ != nullptr) {
+        --alias_->aliases_;
+    } else if (aliases_ != 0) {
+        Handover();
+    }
+
+    impl::registry.Unlink(this);
+    registered_ = false;
+    impl::UnlockRegistry();
+}
+
+bool Cache::Mergeable() const {
+    return (flags_ & kCacheNoMerge) == 0 && !allocator_.Constructs();
+}
+
+Cache* Cache::FindMergeTarget() {
+    if (!Mergeable()) {
+        return nullptr;
+    }
+
+    for (auto it = impl::registry.Begin(); it != impl::registry.End(); ++it) {
+        Cache* cache = &*it;
+
+        if ((cache->flags_ & kCacheStatic) == 0) {
+            continue;
+        }
+        if (cache->alias_ != nullptr || !cache->Mergeable()) {
+            continue;
+        }
+        if (cache->layout_ != layout_) {
+            continue;
+        }
+        return cache;
+    }
+    return nullptr;
+}
+
+// The aliases may still have objects in our slabs, so instead of tearing the
+// slabs down we give them to the first alias, that becomes the merge target
+// for the rest of the aliases. Aliases never allocate slabs themselves, so
+// the heir doesn't have any to begin with, and the slabs stay with the same
+// CPUs.
+void Cache::Handover() {
+    Cache* heir = nullptr;
+
+    for (auto it = impl::registry.Begin(); it != impl::registry.End(); ++it) {
+        if (it->alias_ != this) {
+            continue;
+        }
+        if (heir == nullptr) {
+            heir = &*it;
+            heir->alias_ = nullptr;
+            continue;
+        }
+        it->alias_ = heir;
+        ++heir->aliases_;
+    }
+    aliases_ = 0;
+
+    for (size_t cpu = 0; cpu < impl::kMaxCpus; ++cpu) {
+        CpuSlabs* from = &slabs_[cpu];
+        CpuSlabs* to = &heir->slabs_[cpu];
+
+        heir->Adopt(&to->free, &from->free, this);
+        for (size_t i = 0; i < kPartialLists; ++i) {
+            heir->Adopt(&to->partial[i], &from->partial[i], this);
+        }
+        heir->Adopt(&to->full, &from->full, this);
+
+        // The objects of the aliases stay where they are, so the heir keeps
+        // counting only its own objects, but its slabs are in use by all.
+        to->used += from->used;
+        to->reclaimable += from->reclaimable;
+        from->used = 0;
+        from->reclaimable = 0;
+    }
+}
+
+void Cache::Adopt(SlabList* to, SlabList* from, Cache* cache) {
+    to->Swap(*from);
+    for (auto it = to->Begin(); it != to->End(); ++it) {
+        allocator_.Adopt(&*it, &cache->allocator_, this);
+    }
+}
+
+
+void SetCacheMerging(bool enabled) {
+    impl::merging = enabled;
+}
+
+void DumpCaches() {
+    common::Log() << "Slab caches:\n";
+    impl::LockRegistry();
+    for (auto it = impl::registry.Begin(); it != impl::registry.End(); ++it) {
+        it->Dump();
+    }
+    impl::UnlockRegistry();
+}
+
 }  // namespace memory
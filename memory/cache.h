@@ -1,9 +1,14 @@
 #ifndef __MEMORY_CACHE_H__
 #define __MEMORY_CACHE_H__
 
+#include <algorithm>
 #include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
 
 #include "common/intrusive_list.h"
+#include "common/math.h"
 #include "memory.h"
 
 
@@ -11,27 +16,47 @@ namespace memory {
 
 class Cache;
 
+using Constructor = void (*)(void* ptr);
+using Destructor = void (*)(void* ptr);
+
 namespace impl {
 
 struct Layout {
     size_t object_size;
     size_t object_offset;
+    size_t storage_offset;
     size_t objects;
     size_t control_offset;
     size_t slab_size;
 };
 
+bool operator==(const Layout& l, const Layout& r);
+bool operator!=(const Layout& l, const Layout& r);
+
+
+// Free objects are linked in a singly linked list through Storage placed
+// inside the object (or right after it for caches with constructors), so
+// the smallest object a cache can manage is just one pointer.
+struct Storage {
+    Storage* next;
+};
 
-struct Storage : public common::ListNode<Storage> {
-    void* pointer;
 
-    Storage(void* ptr);
+// Objects freed by CPUs other than the one that allocated their slab are
+// linked in a singly linked list using RemoteStorage placed where the Storage
+// would be.
+struct RemoteStorage {
+    RemoteStorage* next;
 };
 
+// Caches keep separate slabs for every CPU, CPUs get their indices in the
+// order they first use a cache and there may be at most kMaxCpus of them.
+constexpr size_t kMaxCpus = 8;
+
 
 class Slab : public common::ListNode<Slab> {
 public:
-    Slab(const Cache* cache, Contigous mem, Layout layout);
+    Slab(const Cache* cache, size_t cpu, Contigous mem, Layout layout);
     ~Slab();
 
     Slab(const Slab& other) = delete;
@@ -40,46 +65,177 @@ public:
     Slab& operator=(Slab&& other) = delete;
 
     const Cache* Owner() const;
+    void SetOwner(const Cache* cache);
+    size_t Cpu() const;
     Contigous Memory() const;
     size_t Allocated() const;
     bool Empty() const;
+    bool Contains(uintptr_t addr) const;
     void* Allocate();
+    size_t Allocate(void** ptrs, size_t count);
     bool Free(void* ptr);
+    size_t Free(void** ptrs, size_t count);
 
 private:
-    common::IntrusiveList<Storage> freelist_;
+    Storage* StorageFor(void* ptr) const;
+    void* ObjectFor(Storage* storage) const;
+    void Push(void* ptr);
+    void* Pop();
+
+    Storage* freelist_ = nullptr;
     size_t allocated_ = 0;
+    size_t storage_offset_;
     const Cache* cache_;
+    size_t cpu_;
     Contigous memory_;
+    // The range of memory_, Contigous calculates it from the page
+    // descriptor, which is too slow for every free.
+    uintptr_t from_;
+    uintptr_t to_;
 };
 
+constexpr size_t ObjectSize(size_t size, size_t alignment) {
+    return common::AlignUp(std::max(size, sizeof(Storage)), alignment);
+}
+
+// Constructed objects must keep their state while they are free, so we
+// cannot reuse the object memory for the freelist and put the Storage
+// right after the object instead.
+constexpr size_t StorageOffset(size_t size) {
+    return common::AlignUp(size, alignof(Storage));
+}
+
+constexpr size_t ConstructedObjectSize(size_t size, size_t alignment) {
+    return common::AlignUp(
+        StorageOffset(size) + sizeof(Storage),
+        std::max(alignment, alignof(Storage)));
+}
+
+constexpr size_t SlabSize(size_t size, size_t control) {
+    constexpr size_t kMinObjects = 32;
+    constexpr size_t kMinSize = 4096;
+
+    const size_t min_bytes = size * kMinObjects + control;
+
+    size_t slab_size = kMinSize;
+    while (slab_size < min_bytes) {
+        slab_size <<= 1;
+    }
+    return slab_size;
+}
+
+// MakeLayout is constexpr, so that the layout for the caches with the object
+// size known at compile time could be calculated at compile time as well
+// (see TypedCache below).
+constexpr Layout MakeLayout(size_t size, size_t alignment, bool constructed) {
+    const size_t control_size = sizeof(Slab);
+    const size_t object_size = constructed
+        ? ConstructedObjectSize(size, alignment)
+        : ObjectSize(size, alignment);
+    const size_t slab_size = SlabSize(object_size, control_size);
+
+    Layout layout = {};
+    layout.object_size = object_size;
+    layout.object_offset = 0;
+    layout.storage_offset = constructed ? StorageOffset(size) : 0;
+    layout.objects = (slab_size - control_size) / object_size;
+    layout.control_offset = slab_size - control_size;
+    layout.slab_size = slab_size;
+    return layout;
+}
+
+
 class Allocator {
 public:
-    Allocator(Layout layout);
+    constexpr Allocator(
+            struct Layout layout, Constructor ctor, Destructor dtor)
+        : allocated_(0), layout_(layout), ctor_(ctor), dtor_(dtor)
+    {}
 
     Allocator(const Allocator&) = delete;
     Allocator& operator=(const Allocator&) = delete;
     Allocator(Allocator&&) = default;
     Allocator& operator=(Allocator&&) = default;
 
-    Slab* Allocate(const Cache* cache);
+    Slab* Allocate(Cache* cache, size_t cpu);
     void Free(Slab* slab);
+    // Moves the slab allocated by from to this allocator and makes cache the
+    // owner of the slab.
+    void Adopt(Slab* slab, Allocator* from, Cache* cache);
     Slab* Find(void* ptr);
+    // Starts loading the slab control structure and the object pointed to by
+    // ptr into the cache, without checking that ptr belongs to a slab.
+    void Prefetch(const void* ptr) const;
 
+    bool Constructs() const;
     uintptr_t Allocated() const;
     struct Layout Layout() const;
 
 private:
+    static void SetOwner(Contigous mem, Cache* cache);
+
     uintptr_t allocated_;
     struct Layout layout_;
+    Constructor ctor_;
+    Destructor dtor_;
 };
 
 }  // namespace impl
 
 
-class Cache {
+// When ctor is given, it's called for every object when a new slab is
+// populated and dtor is called for every object when the slab is released,
+// like in the original Bonwick's slab allocator. Objects returned from
+// Allocate are therefore already constructed and must be returned to the
+// cache in the constructed state, so the expensive initialization is only
+// paid once per slab and not once per allocation.
+//
+// Every CPU allocates from its own set of slabs, so the slabs and the lists
+// aren't shared and don't need any synchronization. Objects freed on a CPU
+// other than the one that allocated their slab are pushed to the lock-free
+// remote free list of that CPU instead, the CPU drains the list in batches
+// when it runs out of partial slabs. Reclaim only releases the free slabs of
+// the calling CPU. Caches must not be destroyed while other CPUs use them.
+//
+// Caches register themselves in the global registry that DumpCaches below
+// walks. Since the constructor has to stay constexpr, the registration
+// happens when the cache allocates its first slab rather than in the
+// constructor, caches that never allocated anything have nothing to report
+// anyway.
+//
+// At the same time, if there is already a registered static cache with
+// exactly the same layout, the new cache is merged with it: the new cache
+// becomes an alias that forwards all the allocations to the existing one.
+// That way we have fewer partially filled slabs. Every cache only counts the
+// objects allocated through it, so DumpCaches reports the aliases and the
+// merge target separately. Caches with object constructors or destructors
+// are never merged and merging can be disabled altogether with
+// SetCacheMerging for debugging.
+//
+// Only caches that live as long as the kernel are marked with kCacheStatic,
+// so a short-lived cache never serves the objects of other caches. If a
+// static cache is destroyed anyway while its aliases still have objects in
+// its slabs, it hands the slabs over to one of them, which becomes the merge
+// target for the rest. The cache itself must not have any objects left.
+//
+// Caches marked with kCacheNoMerge are never merged with other caches.
+constexpr uint32_t kCacheStatic = 1 << 0;
+constexpr uint32_t kCacheNoMerge = 1 << 1;
+
+class Cache : public common::ListNode<Cache> {
 public:
-    Cache(size_t size, size_t alignment);
+    constexpr Cache(const char* name, size_t size, size_t alignment,
+                    Constructor ctor = nullptr, Destructor dtor = nullptr)
+        : Cache(name,
+                impl::MakeLayout(
+                    size, alignment, ctor != nullptr || dtor != nullptr),
+                ctor, dtor, 0)
+    {}
+    constexpr Cache(const char* name, size_t size, size_t alignment,
+                    uint32_t flags)
+        : Cache(name, impl::MakeLayout(size, alignment, false),
+                nullptr, nullptr, flags)
+    {}
     ~Cache();
 
     Cache(const Cache& other) = delete;
@@ -87,25 +243,166 @@ public:
     Cache(Cache&& other) = delete;
     Cache& operator=(Cache&& other) = delete;
 
+    const char* Name() const;
     size_t Allocated() const;
     size_t Occupied() const;
     size_t Reclaimable() const;
     size_t ObjectSize() const;
+    size_t ObjectsPerSlab() const;
+
+    // Writes a single line of statistics about the cache to the log. The
+    // number of allocations and frees is reported since the previous Dump.
+    void Dump();
 
     bool Reclaim();
     void* Allocate();
     bool Free(void* ptr);
 
+    // Bulk versions of Allocate and Free. AllocateBulk takes objects from one
+    // slab at a time and returns the number of objects actually allocated,
+    // that might be less than count if we ran out of memory. FreeBulk frees
+    // consecutive pointers to the same slab together and returns the number
+    // of objects actually freed.
+    size_t AllocateBulk(void** ptrs, size_t count);
+    size_t FreeBulk(void** ptrs, size_t count);
+
+protected:
+    constexpr Cache(
+            const char* name, impl::Layout layout,
+            Constructor ctor, Destructor dtor, uint32_t flags)
+        : name_(name), layout_(layout), allocator_(layout, ctor, dtor),
+          flags_(flags)
+    {}
+
 private:
+    static constexpr size_t kCacheLineSize = 64;
+
+    // Partially filled slabs are spread over several lists according to how
+    // full they are. Allocations are served from the fullest slabs first, so
+    // that the nearly empty slabs have a chance to drain completely and
+    // become reclaimable.
+    static constexpr size_t kPartialLists = 4;
+
+    using SlabList = common::IntrusiveList<impl::Slab>;
+
+    // The slabs of one CPU. Only that CPU touches the lists and updates the
+    // statistics, the statistics of all CPUs are summed up when reported.
+    // The objects in use in the slabs, including the ones allocated through
+    // the aliases, are counted separately from the objects allocated through
+    // the cache itself.
+    struct CpuSlabs {
+        SlabList free;
+        SlabList partial[kPartialLists];
+        SlabList full;
+        uintptr_t reclaimable = 0;
+        uintptr_t used = 0;
+        uintptr_t allocated = 0;
+        size_t allocations = 0;
+        size_t frees = 0;
+
+        // The only field modified by other CPUs, so it lives in its own
+        // cache line to not disturb the owner.
+        alignas(kCacheLineSize) impl::RemoteStorage* remote = nullptr;
+    };
+
+    SlabList* ListFor(const impl::Slab* slab);
+    void Relink(impl::Slab* slab, SlabList* from);
+    impl::Slab* FullestSlab(size_t cpu);
+    impl::Slab* PartialSlab(size_t cpu);
+    void* AllocateOn(size_t cpu);
+    size_t AllocateBulkOn(size_t cpu, void** ptrs, size_t count);
+    bool FreeOn(size_t cpu, void* ptr);
+    size_t FreeBulkOn(size_t cpu, void** ptrs, size_t count);
+    size_t FreeRun(size_t cpu, impl::Slab* slab, void** ptrs, size_t count);
+    bool FreeSlabObject(impl::Slab* slab, void* ptr);
+    size_t FreeSlabObjects(impl::Slab* slab, void** ptrs, size_t count);
+    void FreeRemote(impl::Slab* slab, void** ptrs, size_t count);
+    bool DrainRemote(size_t cpu);
+    bool ReclaimOn(size_t cpu);
+
+    void Register();
+    void Unregister();
+    bool Mergeable() const;
+    Cache* FindMergeTarget();
+    void Handover();
+    void Adopt(SlabList* to, SlabList* from, Cache* cache);
+    Cache* Target();
+    void AccountAllocations(size_t cpu, size_t objects);
+    void AccountFrees(size_t cpu, size_t objects);
+    size_t Allocations() const;
+    size_t Frees() const;
+    size_t Used() const;
+
+    const char* name_;
     impl::Layout layout_;
     impl::Allocator allocator_;
-    common::IntrusiveList<impl::Slab> free_;
-    common::IntrusiveList<impl::Slab> partial_;
-    common::IntrusiveList<impl::Slab> full_;
-    uintptr_t allocated_ = 0;
-    uintptr_t reclaimable_ = 0;
+    uint32_t flags_;
+    bool registered_ = false;
+    Cache* alias_ = nullptr;
+    size_t aliases_ = 0;
+
+    size_t dumped_allocations_ = 0;
+    size_t dumped_frees_ = 0;
+
+    CpuSlabs slabs_[impl::kMaxCpus];
+};
+
+
+// TypedCache is a Cache of objects of type T. Unlike Cache it's responsible
+// for constructing and destroying the objects, so users don't have to do
+// the casts and placement new themselves.
+//
+// The cache layout is calculated at compile time and the constructor is
+// constexpr, so global TypedCache objects are constant initialized and don't
+// need to be constructed at runtime by __constructors. Declare them with
+// [[clang::no_destroy]] to avoid registering the destructor as well.
+template <typename T>
+class TypedCache : private Cache {
+public:
+    constexpr explicit TypedCache(const char* name, uint32_t flags = 0)
+        : Cache(name, kLayout, nullptr, nullptr, flags)
+    {}
+
+    using Cache::Name;
+    using Cache::Dump;
+    using Cache::Allocated;
+    using Cache::Occupied;
+    using Cache::Reclaimable;
+    using Cache::ObjectSize;
+    using Cache::ObjectsPerSlab;
+    using Cache::Reclaim;
+
+    template <typename... Args>
+    T* New(Args&&... args) {
+        void* ptr = Cache::Allocate();
+        if (ptr == nullptr) {
+            return nullptr;
+        }
+        return ::new (ptr) T(std::forward<Args>(args)...);
+    }
+
+    void Delete(T* ptr) {
+        if (ptr == nullptr) {
+            return;
+        }
+        ptr->~T();
+        Cache::Free(static_cast<void*>(ptr));
+    }
+
+private:
+    static constexpr impl::Layout kLayout =
+        impl::MakeLayout(sizeof(T), alignof(T), false);
 };
 
+
+// Writes statistics of all the registered caches to the log, similar to
+// /proc/slabinfo in Linux.
+void DumpCaches();
+
+// Enables or disables merging of the caches with the same layout, it only
+// affects caches that start allocating after the call.
+void SetCacheMerging(bool enabled);
+
 }  // namespace memory
 
 #endif  // __MEMORY_SLAB_H__
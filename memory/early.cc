@@ -0,0 +1,55 @@
+#include "early.h"
+
+
+namespace memory {
+
+EarlyAllocator::EarlyAllocator(MemoryMap* map)
+    : EarlyAllocator(map, Placement::BOTTOM_UP, Fit::FIRST)
+{}
+
+EarlyAllocator::EarlyAllocator(MemoryMap* map, Placement placement, Fit fit)
+    : map_(map), placement_(placement), fit_(fit)
+{}
+
+bool EarlyAllocator::Allocate(size_t size, size_t alignment, uintptr_t* ret) {
+    return AllocateIn(0, ~static_cast<uintptr_t>(0), size, alignment, ret);
+}
+
+bool EarlyAllocator::AllocateIn(
+        uintptr_t begin, uintptr_t end,
+        size_t size, size_t alignment,
+        uintptr_t* ret) {
+    uintptr_t addr;
+
+    if (size == 0) {
+        return false;
+    }
+
+    if (!map_->Find(
+            begin, end, size, alignment, placement_, fit_, &addr)) {
+        return false;
+    }
+
+    if (!map_->Reserve(addr, addr + size)) {
+        return false;
+    }
+
+    *ret = addr;
+    return true;
+}
+
+bool EarlyAllocator::AllocateNear(
+        uintptr_t begin, uintptr_t end,
+        size_t size, size_t alignment,
+        uintptr_t* ret) {
+    if (AllocateIn(begin, end, size, alignment, ret)) {
+        return true;
+    }
+    return Allocate(size, alignment, ret);
+}
+
+bool EarlyAllocator::Free(uintptr_t begin, uintptr_t end) {
+    return map_->Release(begin, end);
+}
+
+}  // namespace memory
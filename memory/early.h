@@ -0,0 +1,54 @@
+#ifndef __MEMORY_EARLY_H__
+#define __MEMORY_EARLY_H__
+
+#include <cstddef>
+#include <cstdint>
+
+#include "phys.h"
+
+
+namespace memory {
+
+// Allocates physical memory directly from the memory map before the buddy
+// allocator is up. The placement and the fit policies can be changed at any
+// time and affect only the following allocations.
+class EarlyAllocator {
+public:
+    explicit EarlyAllocator(MemoryMap* map);
+    EarlyAllocator(MemoryMap* map, Placement placement, Fit fit);
+
+    EarlyAllocator(const EarlyAllocator&) = delete;
+    EarlyAllocator& operator=(const EarlyAllocator&) = delete;
+    EarlyAllocator(EarlyAllocator&&) = delete;
+    EarlyAllocator& operator=(EarlyAllocator&&) = delete;
+
+    void SetPlacement(Placement placement) { placement_ = placement; }
+    void SetFit(Fit fit) { fit_ = fit; }
+
+    bool Allocate(size_t size, size_t alignment, uintptr_t* ret);
+    bool AllocateIn(
+        uintptr_t begin, uintptr_t end,
+        size_t size, size_t alignment,
+        uintptr_t* ret);
+
+    // Prefers memory within [begin, end), but falls back to any other memory
+    // if there is not enough there. It's used to keep data structures, like
+    // the page descriptors of a zone, close to the memory they describe.
+    bool AllocateNear(
+        uintptr_t begin, uintptr_t end,
+        size_t size, size_t alignment,
+        uintptr_t* ret);
+
+    bool Free(uintptr_t begin, uintptr_t end);
+
+    const MemoryMap& Map() const { return *map_; }
+
+private:
+    MemoryMap* map_;
+    Placement placement_;
+    Fit fit_;
+};
+
+}  // namespace memory
+
+#endif  // __MEMORY_EARLY_H__
@@ -6,6 +6,7 @@
 
 #include "common/fixed_vector.h"
 #include "common/math.h"
+#include "early.h"
 
 
 namespace memory {
@@ -13,13 +14,19 @@ namespace memory {
 namespace {
 
 constexpr uint64_t kPageFree = 1 << 0;
+constexpr size_t kMaxZones = 32;
 
-common::FixedVector<Zone, 32> AllZones;
+common::FixedVector<Zone, kMaxZones> AllZones;
 
 size_t BuddyOffset(size_t offset, size_t order) {
     return offset ^ (static_cast<size_t>(1) << order);
 }
 
+size_t SizeOrder(size_t size) {
+    const size_t power = 1 + common::MostSignificantBit(size - 1);
+    return std::max(power, kPageBits) - kPageBits;
+}
+
 Zone* AddressZone(uintptr_t addr) {
     for (auto it = AllZones.Begin(); it != AllZones.End(); ++it) {
         if (addr >= it->FromAddress() && addr < it->ToAddress()) {
@@ -33,7 +40,7 @@ Zone* AddressZone(uintptr_t addr) {
 
 
 Zone::Zone(Page* page, size_t pages, uintptr_t from, uintptr_t to)
-    : page_(page), pages_(pages), from_(from), to_(to)
+    : page_(page), pages_(pages), available_(0), from_(from), to_(to)
 {}
 
 Page* Zone::AllocatePages(size_t order) {
@@ -56,18 +63,88 @@ void Zone::FreePages(Page* pages) {
 }
 
 void Zone::FreePages(size_t addr) {
-    const size_t offset = addr >> kPageBits;
-    Page* pages = &page_[offset - Offset()];
-    FreePages(pages);
+    FreePages(AddressPage(addr));
 }
 
 void Zone::FreePages(size_t addr, size_t order) {
-    const size_t offset = addr >> kPageBits;
-    Page* pages = &page_[offset - Offset()];
+    Page* pages = AddressPage(addr);
     pages->order = order;
     FreePages(pages);
 }
 
+void Zone::FreeRange(uintptr_t begin, uintptr_t end) {
+    for (uintptr_t addr = begin; addr != end;) {
+        const size_t offset = addr >> kPageBits;
+        const size_t pages = (end - addr) >> kPageBits;
+
+        const size_t align = common::LeastSignificantBit(offset);
+        const size_t size = common::MostSignificantBit(pages);
+        const size_t order = std::min(std::min(align, size), kMaxOrder);
+
+        Page* page = AddressPage(addr);
+        page->order = order;
+        page->flags |= kPageFree;
+        free_[order].LinkAt(free_[order].End(), page);
+
+        available_ += static_cast<size_t>(1) << order;
+        addr += static_cast<uintptr_t>(1) << (kPageBits + order);
+    }
+}
+
+bool Zone::ExtendPages(Page* pages, size_t order) {
+    const size_t offset = Offset();
+    const size_t page_offset = PageOffset(pages);
+    const size_t from = pages->order;
+
+    if (order > kMaxOrder) {
+        return false;
+    }
+
+    for (size_t o = from; o < order; ++o) {
+        const size_t buddy_offset = BuddyOffset(page_offset, o);
+
+        if (buddy_offset < page_offset || buddy_offset - offset >= Pages()) {
+            return false;
+        }
+
+        const Page* buddy = &page_[buddy_offset - offset];
+
+        if (buddy->order != o || (buddy->flags & kPageFree) == 0) {
+            return false;
+        }
+    }
+
+    for (size_t o = from; o < order; ++o) {
+        Page* buddy = &page_[BuddyOffset(page_offset, o) - offset];
+
+        free_[o].Unlink(buddy);
+        buddy->flags &= ~kPageFree;
+    }
+
+    pages->order = order;
+    available_ -= (static_cast<size_t>(1) << order) -
+        (static_cast<size_t>(1) << from);
+    return true;
+}
+
+void Zone::ShrinkPages(Page* pages, size_t order) {
+    const size_t offset = Offset();
+    const size_t page_offset = PageOffset(pages);
+    const size_t from = pages->order;
+
+    for (size_t o = from; o-- > order;) {
+        Page* buddy = &page_[BuddyOffset(page_offset, o) - offset];
+
+        Unite(buddy, o);
+    }
+
+    if (from > order) {
+        pages->order = order;
+        available_ += (static_cast<size_t>(1) << from) -
+            (static_cast<size_t>(1) << order);
+    }
+}
+
 size_t Zone::Offset() const { return FromAddress() >> kPageBits; }
 
 size_t Zone::PageOffset(const Page* page) const {
@@ -78,6 +155,10 @@ uintptr_t Zone::PageAddress(const Page* page) const {
     return FromAddress() + ((page - page_) << kPageBits);
 }
 
+Page* Zone::AddressPage(uintptr_t addr) {
+    return &page_[(addr >> kPageBits) - Offset()];
+}
+
 size_t Zone::Pages() const { return pages_; }
 
 size_t Zone::Available() const { return available_; }
@@ -186,8 +267,7 @@ std::optional<Contigous> AllocatePhysical(size_t size) {
         return Contigous(nullptr);
     }
 
-    const size_t power = 1 + common::MostSignificantBit(size - 1);
-    const size_t order = std::max(power, kPageBits) - kPageBits;
+    const size_t order = SizeOrder(size);
 
     if (order > kMaxOrder) {
         return std::nullopt;
@@ -218,6 +298,46 @@ void FreePhysical(uintptr_t addr) {
     zone->FreePages(addr);    
 }
 
+bool ResizePhysical(Contigous* mem, size_t size) {
+    if (mem->Size() == 0 || size == 0) {
+        return false;
+    }
+
+    const size_t order = SizeOrder(size);
+    if (order > kMaxOrder) {
+        return false;
+    }
+
+    if (order < mem->Order()) {
+        mem->Zone()->ShrinkPages(mem->Pages(), order);
+    } else if (order > mem->Order()) {
+        if (!mem->Zone()->ExtendPages(mem->Pages(), order)) {
+            return false;
+        }
+    }
+
+    *mem = Contigous(mem->Zone(), mem->Pages(), order);
+    return true;
+}
+
+bool ResizePhysical(uintptr_t addr, size_t size) {
+    if (addr == 0) {
+        return false;
+    }
+    Zone* zone = AddressZone(addr);
+    Page* pages = zone->AddressPage(addr);
+    Contigous mem(zone, pages, pages->order);
+    return ResizePhysical(&mem, size);
+}
+
+Page* AddressPage(uintptr_t addr) {
+    Zone* zone = AddressZone(addr);
+    if (zone == nullptr) {
+        return nullptr;
+    }
+    return zone->AddressPage(addr);
+}
+
 
 size_t TotalPhysical() {
     size_t total = 0;
@@ -242,7 +362,7 @@ size_t AvailablePhysical() {
 
 namespace {
 
-bool CreateZone(uintptr_t begin, uintptr_t end, MemoryMap* mmap) {
+bool CreateZone(uintptr_t begin, uintptr_t end, EarlyAllocator* early) {
     begin = common::AlignUp(begin, static_cast<uintptr_t>(kPageSize));
     end = common::AlignDown(end, static_cast<uintptr_t>(kPageSize));
     if (begin >= end) {
@@ -253,10 +373,8 @@ bool CreateZone(uintptr_t begin, uintptr_t end, MemoryMap* mmap) {
     const size_t bytes = pages * sizeof(struct Page);
 
     uintptr_t addr;
-    if (!mmap->AllocateIn(begin, end, bytes, kPageSize, &addr)) {
-        if (!mmap->Allocate(bytes, kPageSize, &addr)) {
-            return false;
-        }
+    if (!early->AllocateNear(begin, end, bytes, kPageSize, &addr)) {
+        return false;
     }
 
     struct Page* page = reinterpret_cast<struct Page*>(addr);
@@ -264,32 +382,47 @@ bool CreateZone(uintptr_t begin, uintptr_t end, MemoryMap* mmap) {
     return AllZones.EmplaceBack(page, pages, begin, end);    
 }
 
-bool CreateZones(MemoryMap* mmap) {
-    if (mmap->ConstBegin() == mmap->ConstEnd()) {
+bool CreateZones(EarlyAllocator* early) {
+    const MemoryMap& mmap = early->Map();
+
+    if (mmap.ConstBegin() == mmap.ConstEnd()) {
         return true;
     }
 
-    // We will iterate over the copy to avoid invalidating iterators.
-    static MemoryMap copy = *mmap;
-    auto first = copy.ConstBegin();
-    uintptr_t begin = first->begin;
-    uintptr_t end = first->end;
-
-    for (auto it = ++first; it != copy.ConstEnd(); ++it) {
-        if (end == it->begin) {
-            end = it->end;
+    // Creating zones changes the memory map, so we collect the contiguous
+    // ranges first and only then create zones for them. Every range needs a
+    // zone of its own, so with more ranges than there are zones left we
+    // fail before creating any of them.
+    common::FixedVector<MemoryRange, kMaxZones> spans;
+    auto first = mmap.ConstBegin();
+    MemoryRange span = *first;
+
+    for (auto it = ++first; it != mmap.ConstEnd(); ++it) {
+        if (span.end == it->begin) {
+            span.end = it->end;
             continue;
         }
 
-        if (!CreateZone(begin, end, mmap)) {
+        if (!spans.PushBack(span)) {
             return false;
         }
+        span = *it;
+    }
+
+    if (!spans.PushBack(span)) {
+        return false;
+    }
 
-        begin = it->begin;
-        end = it->end;
+    if (spans.Size() > kMaxZones - AllZones.Size()) {
+        return false;
     }
 
-    return CreateZone(begin, end, mmap);
+    for (auto it = spans.ConstBegin(); it != spans.ConstEnd(); ++it) {
+        if (!CreateZone(it->begin, it->end, early)) {
+            return false;
+        }
+    }
+    return true;
 }
 
 bool FreeMemory(Zone* zone, uintptr_t begin, uintptr_t end) {
@@ -311,25 +444,18 @@ bool FreeMemory(Zone* zone, uintptr_t begin, uintptr_t end) {
         return true;
     }
 
-    for (uintptr_t addr = begin; addr != end;) {
-        const size_t offset = addr >> kPageBits;
-        const size_t pages = (end - addr) >> kPageBits;
-
-        const size_t align = common::LeastSignificantBit(offset);
-        const size_t size = common::MostSignificantBit(pages);
-        const size_t order = std::min(std::min(align, size), kMaxOrder);
-
-        zone->FreePages(addr, order);
-        addr += static_cast<uintptr_t>(1) << (kPageBits + order);
-    }
+    zone->FreeRange(begin, end);
     return true;
 }
 
-bool FreeUnusedMemory(MemoryMap* mmap) {
+// Hands all the free memory left in the memory map over to the zones in one
+// pass. Free ranges in the map are never adjacent, so the blocks don't need
+// to be merged with their buddies.
+bool FreeUnusedMemory(const MemoryMap& mmap) {
     auto zone = AllZones.Begin();
-    auto range = mmap->ConstBegin();
+    auto range = mmap.ConstBegin();
 
-    for (; range != mmap->ConstEnd(); ++range) {
+    for (; range != mmap.ConstEnd(); ++range) {
         if (range->status != MemoryStatus::FREE) {
             continue;
         }
@@ -362,10 +488,15 @@ bool FreeUnusedMemory(MemoryMap* mmap) {
 
 
 bool SetupAllocator(MemoryMap* mmap) {
-    if (!CreateZones(mmap)) {
+    // Page descriptors go to the top of their own zone, into the smallest
+    // free range that fits them, to leave large free ranges intact and low
+    // memory free.
+    EarlyAllocator early(mmap, Placement::TOP_DOWN, Fit::BEST);
+
+    if (!CreateZones(&early)) {
         return false;
     }
-    return FreeUnusedMemory(mmap);
+    return FreeUnusedMemory(*mmap);
 }
 
 }  // namespace memory
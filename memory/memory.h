@@ -14,10 +14,15 @@ constexpr size_t kMaxOrder = 20;
 constexpr size_t kPageBits = 12;
 constexpr size_t kPageSize = (1 << kPageBits);
 
+class Cache;
+
 
 struct Page : public common::ListNode<Page> {
     uint64_t flags;
     size_t order;
+    // Slab cache that the page belongs to, all pages of a slab point to the
+    // owning cache, so that we can find the cache for any object address.
+    Cache* cache;
 };
 
 
@@ -35,9 +40,23 @@ public:
     void FreePages(uintptr_t addr);
     void FreePages(uintptr_t addr, size_t order);
 
+    // Adds all the pages in [begin, end) to the free lists at once using
+    // the largest blocks possible. Unlike FreePages it doesn't try to merge
+    // the blocks with their buddies, so the pages around the range must not
+    // be free.
+    void FreeRange(uintptr_t begin, uintptr_t end);
+
+    // Changes the order of an allocated block in place. Growing merges the
+    // following free buddies into the block and only succeeds when the block
+    // is the lower half of all the buddy pairs on the way, shrinking returns
+    // the tail of the block to the free lists.
+    bool ExtendPages(Page* pages, size_t order);
+    void ShrinkPages(Page* pages, size_t order);
+
     size_t Offset() const;
     size_t PageOffset(const Page* page) const;
     uintptr_t PageAddress(const Page* page) const;
+    Page* AddressPage(uintptr_t addr);
     size_t Pages() const;
     size_t Available() const;
     uintptr_t FromAddress() const;
@@ -61,7 +80,7 @@ class Contigous {
 public:
     Contigous();
     Contigous(nullptr_t);
-    Contigous(Zone* zone, Page* pages, size_t order);
+    Contigous(class Zone* zone, Page* pages, size_t order);
 
     Contigous(const Contigous& other) = default;
     Contigous& operator=(const Contigous& other) = default;
@@ -88,12 +107,24 @@ bool operator==(const Contigous& l, const Contigous& r);
 bool operator!=(const Contigous& l, const Contigous& r);
 
 
+// Creates a zone for every contiguous span of the memory map and frees the
+// free ranges of the map into them. Fails without creating any zone if the
+// map has more than 32 disjoint spans.
 bool SetupAllocator(MemoryMap* map);
 
 std::optional<Contigous> AllocatePhysical(size_t size);
 void FreePhysical(Contigous mem);
 void FreePhysical(uintptr_t addr);
 
+// Tries to change the size of the allocated memory without moving it, on
+// success mem is updated to describe the resized memory.
+bool ResizePhysical(Contigous* mem, size_t size);
+bool ResizePhysical(uintptr_t addr, size_t size);
+
+// Returns the page descriptor for the given physical address or nullptr if
+// the address doesn't belong to any zone.
+Page* AddressPage(uintptr_t addr);
+
 size_t TotalPhysical();
 size_t AvailablePhysical();
 
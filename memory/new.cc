@@ -0,0 +1,90 @@
+#include <new>
+
+#include "alloc.h"
+
+
+namespace {
+
+[[ noreturn ]] void Panic() {
+    while (1) {
+        asm volatile("":::"memory");
+    }
+}
+
+void* Check(void* ptr) {
+    if (ptr == nullptr) {
+        Panic();
+    }
+    return ptr;
+}
+
+size_t Alignment(std::align_val_t align) {
+    return static_cast<size_t>(align);
+}
+
+}  // namespace
+
+
+void* operator new(size_t size) { return Check(memory::Allocate(size)); }
+
+void* operator new[](size_t size) { return Check(memory::Allocate(size)); }
+
+void* operator new(size_t size, std::align_val_t align) {
+    return Check(memory::AllocateAligned(size, Alignment(align)));
+}
+
+void* operator new[](size_t size, std::align_val_t align) {
+    return Check(memory::AllocateAligned(size, Alignment(align)));
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return memory::Allocate(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return memory::Allocate(size);
+}
+
+void* operator new(
+        size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+    return memory::AllocateAligned(size, Alignment(align));
+}
+
+void* operator new[](
+        size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+    return memory::AllocateAligned(size, Alignment(align));
+}
+
+// Compilers generate calls to operator delete from deleting destructors of
+// classes with virtual destructors, and when the size of the object is
+// known to the compiler it prefers the sized versions, which don't need to
+// look up the owner of the pointer at all.
+void operator delete(void* ptr) noexcept { memory::Free(ptr); }
+
+void operator delete[](void* ptr) noexcept { memory::Free(ptr); }
+
+void operator delete(void* ptr, size_t size) noexcept {
+    memory::Free(ptr, size);
+}
+
+void operator delete[](void* ptr, size_t size) noexcept {
+    memory::Free(ptr, size);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept {
+    memory::Free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+    memory::Free(ptr);
+}
+
+void operator delete(
+        void* ptr, size_t size, std::align_val_t align) noexcept {
+    memory::FreeAligned(ptr, size, Alignment(align));
+}
+
+void operator delete[](
+        void* ptr, size_t size, std::align_val_t align) noexcept {
+    memory::FreeAligned(ptr, size, Alignment(align));
+}
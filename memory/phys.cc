@@ -1,8 +1,10 @@
 #include "phys.h"
 
 #include <algorithm>
+#include <cstring>
 
 #include "common/math.h"
+#include "memory.h"
 
 
 namespace memory {
@@ -13,127 +15,653 @@ bool CanMerge(const MemoryRange& prev, const MemoryRange& next) {
     return next.begin == prev.end && next.status == prev.status;
 }
 
-bool IsEmpty(const MemoryRange& range) {
-    return range.begin == range.end;
+uintptr_t FreeSize(const MemoryRange& range) {
+    if (range.status != MemoryStatus::FREE) {
+        return 0;
+    }
+    return range.end - range.begin;
 }
 
-MemoryRange* Compact(MemoryRange* begin, MemoryRange* end) {
-    if (begin == end) {
-        return end;
+bool UpdateLess(const MemoryUpdate& l, const MemoryUpdate& r) {
+    if (l.operation != r.operation) {
+        return l.operation < r.operation;
     }
+    return l.begin < r.begin;
+}
+
+// Merges overlapping and adjacent updates of the same kind in the sorted
+// array and returns the new size, or fails if two registrations with
+// different statuses overlap.
+bool MergeUpdates(MemoryUpdate* updates, size_t size, size_t* merged) {
+    size_t count = 0;
+
+    for (size_t i = 0; i < size; ++i) {
+        const MemoryUpdate& update = updates[i];
 
-    MemoryRange* pos = begin;
-    for (MemoryRange* it = pos + 1; it != end; ++it) {
-        if (CanMerge(*pos, *it)) {
-            pos->end = it->end;
+        if (update.begin >= update.end) {
             continue;
         }
 
-        if (IsEmpty(*pos)) {
-            *pos = *it;
-        } else {
-            ++pos;
-            *pos = *it;
+        if (count > 0 && updates[count - 1].operation == update.operation) {
+            MemoryUpdate& last = updates[count - 1];
+            const bool same = update.operation != MemoryOperation::REGISTER
+                || update.status == last.status;
+
+            if (!same && update.begin < last.end) {
+                return false;
+            }
+
+            if (same && update.begin <= last.end) {
+                last.end = std::max(last.end, update.end);
+                continue;
+            }
         }
+
+        updates[count++] = update;
+    }
+
+    *merged = count;
+    return true;
+}
+
+// Places the block within the intersection of the range and [begin, end).
+bool Place(
+        const MemoryRange& range,
+        uintptr_t begin, uintptr_t end,
+        size_t size, size_t alignment, Placement placement,
+        uintptr_t* ret) {
+    const uintptr_t from = std::max(range.begin, begin);
+    const uintptr_t to = std::min(range.end, end);
+
+    if (from >= to || to - from < size) {
+        return false;
     }
 
-    if (IsEmpty(*pos)) {
-        return pos;
+    uintptr_t addr;
+    if (placement == Placement::BOTTOM_UP) {
+        addr = common::AlignUp(from, static_cast<uintptr_t>(alignment));
+        if (addr < from || addr > to - size) {
+            return false;
+        }
+    } else {
+        addr = common::AlignDown(to - size, static_cast<uintptr_t>(alignment));
+        if (addr < from) {
+            return false;
+        }
     }
-    return pos + 1;
+
+    *ret = addr;
+    return true;
 }
 
 }  // namespace
 
 
-bool MemoryMap::SetStatus(uintptr_t begin, uintptr_t end, MemoryStatus status) {
-    MemoryRange range;
-    range.begin = begin;
-    range.end = end;
-    range.status = status;
+MemoryMap::MemoryMap()
+    : nodes_(embedded_)
+    , capacity_(kEmbeddedNodes)
+    , used_(0)
+    , live_(0)
+    , free_(kNone)
+    , root_(kNone)
+    , first_(kNone)
+    , last_(kNone)
+    , size_(0)
+{}
+
+MemoryMap::~MemoryMap() {
+    if (nodes_ != embedded_) {
+        FreePhysical(reinterpret_cast<uintptr_t>(nodes_));
+    }
+}
 
-    auto less = [](const MemoryRange& l, const MemoryRange& r) -> bool {
-        return l.end <= r.begin;
-    };
+bool MemoryMap::EnsureCapacity(size_t nodes) {
+    if (capacity_ - live_ >= nodes) {
+        return true;
+    }
 
-    MemoryRange *from = std::lower_bound(
-        ranges_.Begin(), ranges_.End(), range, less);
-    MemoryRange *to = std::upper_bound(
-        ranges_.Begin(), ranges_.End(), range, less);
+    const size_t size = std::max(
+        2 * static_cast<size_t>(capacity_),
+        static_cast<size_t>(live_) + nodes) * sizeof(Node);
+    std::optional<Contigous> mem = AllocatePhysical(size);
+    if (!mem) {
+        return false;
+    }
 
-    if (from == to) {
-        return true;
+    Node* storage = reinterpret_cast<Node*>(mem->FromAddress());
+    memcpy(storage, nodes_, used_ * sizeof(Node));
+    if (nodes_ != embedded_) {
+        FreePhysical(reinterpret_cast<uintptr_t>(nodes_));
     }
+    nodes_ = storage;
+    capacity_ = mem->Size() / sizeof(Node);
+    return true;
+}
 
-    if (from->begin < range.begin) {
-        MemoryRange head;
-        head.begin = from->begin;
-        head.end = range.begin;
-        head.status = from->status;
+// An insert splits at most one node on every level of the tree and may add
+// a new root on top of that.
+uint32_t MemoryMap::InsertCost() const {
+    uint32_t cost = 2;
 
-        from->begin = head.end;
-        if (!ranges_.Insert(from, head)) {
-            return false;
+    for (uint32_t node = root_; node != kNone && !nodes_[node].leaf;) {
+        node = nodes_[node].i.children[0];
+        ++cost;
+    }
+    return cost;
+}
+
+// Sums up how many entries every node has over the half of its capacity.
+size_t MemoryMap::Slack(uint32_t node) const {
+    static_assert(kLeafRanges == kFanout, "Nodes must split in equal halves");
+    const Node& n = nodes_[node];
+    size_t slack = n.count > kFanout / 2 ? n.count - kFanout / 2 : 0;
+
+    if (!n.leaf) {
+        for (uint32_t i = 0; i < n.count; ++i) {
+            slack += Slack(n.i.children[i]);
         }
+    }
+    return slack;
+}
 
-        ++from;
-        ++to;
+// A node splits only when it's full and both halves get half of the entries,
+// so for every split the node had to gain half of its capacity since it was
+// created or, for the nodes that are already in the tree, the slack it has
+// now. Every update adds at most two ranges to the leaves and every split
+// adds a child to the level above, which bounds the splits level by level.
+// On top of that the last update still checks for its own worst case.
+size_t MemoryMap::BatchCost(size_t updates) const {
+    const size_t half = kFanout / 2;
+    const size_t slack = root_ == kNone ? 0 : Slack(root_);
+    const size_t height = root_ == kNone ? 0 : InsertCost() - 1;
+    size_t levels = height;
+    size_t nodes = root_ == kNone ? 1 : 0;
+
+    for (size_t level = 0, added = 2 * updates; added != 0; ++level) {
+        const size_t splits = ((level < height ? slack : 0) + added) / half;
+
+        nodes += splits;
+        if (splits != 0 && level + 1 >= levels) {
+            levels = level + 2;
+            ++nodes;
+        }
+        added = splits;
     }
+    return nodes + 2 * (levels + 1) + 1;
+}
 
-    if ((to - 1)->end > range.end) {
-        MemoryRange tail;
-        tail.begin = range.end;
-        tail.end = (to - 1)->end;
-        tail.status = (to - 1)->status;
+uint32_t MemoryMap::NewNode(bool leaf) {
+    uint32_t node;
 
-        (to - 1)->end = tail.begin;
-        if (!ranges_.Insert(to, tail)) {
-            return false;
+    if (free_ != kNone) {
+        node = free_;
+        free_ = nodes_[node].parent;
+    } else {
+        node = used_++;
+    }
+
+    Node& n = nodes_[node];
+    n.parent = kNone;
+    n.count = 0;
+    n.leaf = leaf;
+    if (leaf) {
+        n.l.prev = n.l.next = kNone;
+    }
+    ++live_;
+    return node;
+}
+
+void MemoryMap::FreeNode(uint32_t node) {
+    nodes_[node].parent = free_;
+    free_ = node;
+    --live_;
+}
+
+MemoryMap::Position MemoryMap::Next(Position pos) const {
+    const Node& n = nodes_[pos.leaf];
+
+    if (pos.index + 1 < n.count) {
+        return Position{pos.leaf, pos.index + 1};
+    }
+    return Position{n.l.next, 0};
+}
+
+MemoryMap::Position MemoryMap::Prev(Position pos) const {
+    if (pos.index > 0) {
+        return Position{pos.leaf, pos.index - 1};
+    }
+
+    const uint32_t prev = nodes_[pos.leaf].l.prev;
+    if (prev == kNone) {
+        return Position{kNone, 0};
+    }
+    return Position{prev, nodes_[prev].count - 1};
+}
+
+// Returns the position of the first range that ends after the address.
+MemoryMap::Position MemoryMap::Lookup(uintptr_t addr) const {
+    if (root_ == kNone) {
+        return Position{kNone, 0};
+    }
+
+    uint32_t node = root_;
+    while (!nodes_[node].leaf) {
+        const Inner& in = nodes_[node].i;
+        uint32_t child = nodes_[node].count - 1;
+
+        while (child > 0 && in.keys[child] > addr) {
+            --child;
+        }
+        node = in.children[child];
+    }
+
+    const Node& leaf = nodes_[node];
+    for (uint32_t i = 0; i < leaf.count; ++i) {
+        if (leaf.l.ranges[i].end > addr) {
+            return Position{node, i};
+        }
+    }
+    return Position{leaf.l.next, 0};
+}
+
+uintptr_t MemoryMap::FirstAddress(uint32_t node) const {
+    const Node& n = nodes_[node];
+    return n.leaf ? n.l.ranges[0].begin : n.i.keys[0];
+}
+
+uintptr_t MemoryMap::MaxFree(uint32_t node) const {
+    const Node& n = nodes_[node];
+    uintptr_t max_free = 0;
+
+    for (uint32_t i = 0; i < n.count; ++i) {
+        max_free = std::max(
+            max_free, n.leaf ? FreeSize(n.l.ranges[i]) : n.i.max_free[i]);
+    }
+    return max_free;
+}
+
+uint32_t MemoryMap::ChildIndex(uint32_t parent, uint32_t child) const {
+    const Node& p = nodes_[parent];
+    uint32_t i = 0;
+
+    while (p.i.children[i] != child) {
+        ++i;
+    }
+    return i;
+}
+
+// Propagates changes of the node to all its ancestors.
+void MemoryMap::Update(uint32_t node) {
+    for (uint32_t parent = nodes_[node].parent;
+            parent != kNone;
+            node = parent, parent = nodes_[node].parent) {
+        const uint32_t i = ChildIndex(parent, node);
+        nodes_[parent].i.keys[i] = FirstAddress(node);
+        nodes_[parent].i.max_free[i] = MaxFree(node);
+    }
+}
+
+void MemoryMap::InsertChild(uint32_t parent, uint32_t after, uint32_t child) {
+    if (parent == kNone) {
+        parent = NewNode(/* leaf = */false);
+        Node& root = nodes_[parent];
+        root.count = 1;
+        root.i.children[0] = after;
+        root.i.keys[0] = FirstAddress(after);
+        root.i.max_free[0] = MaxFree(after);
+        nodes_[after].parent = parent;
+        root_ = parent;
+    }
+
+    if (nodes_[parent].count == kFanout) {
+        const uint32_t right = NewNode(/* leaf = */false);
+        Node& l = nodes_[parent];
+        Node& r = nodes_[right];
+        const uint32_t half = kFanout / 2;
+
+        for (uint32_t i = half; i < kFanout; ++i) {
+            r.i.children[i - half] = l.i.children[i];
+            r.i.keys[i - half] = l.i.keys[i];
+            r.i.max_free[i - half] = l.i.max_free[i];
+            nodes_[l.i.children[i]].parent = right;
+        }
+        r.count = kFanout - half;
+        l.count = half;
+
+        InsertChild(l.parent, parent, right);
+        Update(parent);
+        if (nodes_[after].parent == right) {
+            parent = right;
         }
     }
 
-    for (MemoryRange *it = from; it != to; ++to) {
-        it->status = status;
+    Node& p = nodes_[parent];
+    const uint32_t pos = ChildIndex(parent, after) + 1;
+    for (uint32_t i = p.count; i > pos; --i) {
+        p.i.children[i] = p.i.children[i - 1];
+        p.i.keys[i] = p.i.keys[i - 1];
+        p.i.max_free[i] = p.i.max_free[i - 1];
+    }
+    p.i.children[pos] = child;
+    p.i.keys[pos] = FirstAddress(child);
+    p.i.max_free[pos] = MaxFree(child);
+    nodes_[child].parent = parent;
+    ++p.count;
+    Update(parent);
+}
+
+// Nodes are only removed once they become empty and are never merged with
+// their neighbours, so the height of the tree is bounded by the largest
+// number of ranges the map ever had.
+void MemoryMap::RemoveChild(uint32_t parent, uint32_t child) {
+    if (parent == kNone) {
+        root_ = kNone;
+        return;
+    }
+
+    Node& p = nodes_[parent];
+    const uint32_t pos = ChildIndex(parent, child);
+    for (uint32_t i = pos + 1; i < p.count; ++i) {
+        p.i.children[i - 1] = p.i.children[i];
+        p.i.keys[i - 1] = p.i.keys[i];
+        p.i.max_free[i - 1] = p.i.max_free[i];
+    }
+    --p.count;
+
+    if (p.count == 0) {
+        RemoveChild(p.parent, parent);
+        FreeNode(parent);
+        return;
+    }
+
+    if (parent == root_ && p.count == 1) {
+        root_ = p.i.children[0];
+        nodes_[root_].parent = kNone;
+        FreeNode(parent);
+        return;
+    }
+
+    Update(parent);
+}
+
+// Inserts the range before the given position and returns the position of
+// the inserted range. The caller must make sure that there are enough free
+// nodes for the insert.
+MemoryMap::Position MemoryMap::Insert(Position pos, const MemoryRange& range) {
+    if (root_ == kNone) {
+        root_ = first_ = last_ = NewNode(/* leaf = */true);
+        pos = Position{root_, 0};
+    }
+
+    if (pos.leaf == kNone) {
+        pos = Position{last_, nodes_[last_].count};
+    }
+
+    uint32_t other = kNone;
+    if (nodes_[pos.leaf].count == kLeafRanges) {
+        const uint32_t right = NewNode(/* leaf = */true);
+        Node& l = nodes_[pos.leaf];
+        Node& r = nodes_[right];
+        const uint32_t half = kLeafRanges / 2;
+
+        for (uint32_t i = half; i < kLeafRanges; ++i) {
+            r.l.ranges[i - half] = l.l.ranges[i];
+        }
+        r.count = kLeafRanges - half;
+        l.count = half;
+
+        r.l.prev = pos.leaf;
+        r.l.next = l.l.next;
+        if (l.l.next == kNone) {
+            last_ = right;
+        } else {
+            nodes_[l.l.next].l.prev = right;
+        }
+        l.l.next = right;
+
+        InsertChild(l.parent, pos.leaf, right);
+
+        other = right;
+        if (pos.index > half) {
+            other = pos.leaf;
+            pos = Position{right, pos.index - half};
+        }
     }
 
-    ranges_.Erase(
-        Compact(ranges_.Begin(), ranges_.End()),
-        ranges_.End());
+    Node& n = nodes_[pos.leaf];
+    for (uint32_t i = n.count; i > pos.index; --i) {
+        n.l.ranges[i] = n.l.ranges[i - 1];
+    }
+    n.l.ranges[pos.index] = range;
+    ++n.count;
+    ++size_;
+
+    Update(pos.leaf);
+    if (other != kNone) {
+        Update(other);
+    }
+    return pos;
+}
+
+// Erases the range at the given position and returns the position of the
+// range that followed it.
+MemoryMap::Position MemoryMap::Erase(Position pos) {
+    Node& n = nodes_[pos.leaf];
+
+    for (uint32_t i = pos.index + 1; i < n.count; ++i) {
+        n.l.ranges[i - 1] = n.l.ranges[i];
+    }
+    --n.count;
+    --size_;
+
+    if (n.count > 0) {
+        Update(pos.leaf);
+        return pos.index < n.count ? pos : Position{n.l.next, 0};
+    }
+
+    const uint32_t prev = n.l.prev;
+    const uint32_t next = n.l.next;
+    if (prev == kNone) {
+        first_ = next;
+    } else {
+        nodes_[prev].l.next = next;
+    }
+    if (next == kNone) {
+        last_ = prev;
+    } else {
+        nodes_[next].l.prev = prev;
+    }
+
+    RemoveChild(n.parent, pos.leaf);
+    FreeNode(pos.leaf);
+    return Position{next, 0};
+}
+
+// Splits the range containing the address in two, so that the address is at
+// the boundary between ranges.
+void MemoryMap::SplitAt(uintptr_t addr) {
+    const Position pos = Lookup(addr);
+    if (pos.leaf == kNone) {
+        return;
+    }
+
+    MemoryRange& range = At(pos);
+    if (range.begin >= addr) {
+        return;
+    }
+
+    MemoryRange head = range;
+    head.end = addr;
+    range.begin = addr;
+    Insert(pos, head);
+}
+
+// Merges the ranges within [begin, end) and the ranges adjacent to it, if
+// they have the same status.
+void MemoryMap::Coalesce(uintptr_t begin, uintptr_t end) {
+    Position pos = Lookup(begin);
+    if (pos.leaf == kNone) {
+        return;
+    }
+
+    const Position prev = Prev(pos);
+    if (prev.leaf != kNone) {
+        pos = prev;
+    }
+
+    while (true) {
+        const Position next = Next(pos);
+        if (next.leaf == kNone || At(next).begin > end) {
+            return;
+        }
+
+        if (CanMerge(At(pos), At(next))) {
+            At(pos).end = At(next).end;
+            Erase(next);
+            Update(pos.leaf);
+            continue;
+        }
+
+        pos = next;
+        if (At(pos).begin >= end) {
+            return;
+        }
+    }
+}
+
+bool MemoryMap::SetStatus(uintptr_t begin, uintptr_t end, MemoryStatus status) {
+    if (begin >= end) {
+        return true;
+    }
+
+    Position pos = Lookup(begin);
+    if (pos.leaf == kNone || At(pos).begin >= end) {
+        return true;
+    }
+
+    const MemoryRange& head = At(pos);
+    if (head.status == status && head.begin <= begin && head.end >= end) {
+        return true;
+    }
+
+    // Make sure upfront that both splits will succeed, so that we don't
+    // leave the map half updated. The first split may add a level to the
+    // tree, so the second one may need one more node.
+    if (!EnsureCapacity(2 * InsertCost() + 1)) {
+        return false;
+    }
+
+    SplitAt(begin);
+    SplitAt(end);
+
+    for (pos = Lookup(begin);
+            pos.leaf != kNone && At(pos).begin < end;
+            pos = Next(pos)) {
+        At(pos).status = status;
+        Update(pos.leaf);
+    }
+
+    Coalesce(begin, end);
+    return true;
+}
+
+bool MemoryMap::CanRegister(
+        uintptr_t begin, uintptr_t end, MemoryStatus status) const {
+    for (Position it = Lookup(begin);
+            it.leaf != kNone && At(it).begin < end;
+            it = Next(it)) {
+        if (At(it).status != status) {
+            return false;
+        }
+    }
     return true;
 }
 
 bool MemoryMap::Register(uintptr_t begin, uintptr_t end, MemoryStatus status) {
+    if (begin >= end) {
+        return true;
+    }
+
+    if (!CanRegister(begin, end, status)) {
+        return false;
+    }
+
+    const Position pos = Lookup(begin);
+
     MemoryRange range;
     range.begin = begin;
     range.end = end;
     range.status = status;
 
-    auto less = [](const MemoryRange& l, const MemoryRange& r) -> bool {
-        return l.end <= r.begin;
-    };
+    if (pos.leaf == kNone || At(pos).begin >= end) {
+        if (!EnsureCapacity(InsertCost())) {
+            return false;
+        }
+        Insert(pos, range);
+        Coalesce(begin, end);
+        return true;
+    }
+
+    // Overlapping ranges are all merged into the first one.
+    for (Position next = Next(pos);
+            next.leaf != kNone && At(next).begin < end;
+            next = Next(pos)) {
+        range.end = std::max(range.end, At(next).end);
+        Erase(next);
+    }
 
-    auto from = std::lower_bound(
-        ranges_.Begin(), ranges_.End(), range, less);
-    auto to = std::upper_bound(
-        ranges_.Begin(), ranges_.End(), range, less);
+    range.begin = std::min(range.begin, At(pos).begin);
+    range.end = std::max(range.end, At(pos).end);
+    At(pos) = range;
+    Update(pos.leaf);
 
-    if (from == to) {
-        return ranges_.Insert(from, range);
+    Coalesce(range.begin, range.end);
+    return true;
+}
+
+bool MemoryMap::ApplyBatch(MemoryUpdate* updates, size_t size) {
+    std::sort(updates, updates + size, UpdateLess);
+    if (!MergeUpdates(updates, size, &size)) {
+        return false;
     }
 
-    for (auto it = from; it != to; ++it) {
-        if (it->status != range.status) {
+    // Check everything that can fail before the first change, so a failed
+    // batch leaves the map as it was. Registrations in the batch never
+    // overlap each other with different statuses, so it's enough to check
+    // them against the map as it is now.
+    for (size_t i = 0; i < size; ++i) {
+        const MemoryUpdate& update = updates[i];
+
+        if (update.operation == MemoryOperation::REGISTER
+                && !CanRegister(update.begin, update.end, update.status)) {
             return false;
         }
     }
 
-    range.begin = std::min(range.begin, from->begin);
-    range.end = std::max(range.end, (to - 1)->end);
+    if (size > 0 && !EnsureCapacity(BatchCost(size))) {
+        return false;
+    }
 
-    ranges_.Insert(ranges_.Erase(from, to), range);
-    ranges_.Erase(
-        Compact(ranges_.Begin(), ranges_.End()),
-        ranges_.End());
+    for (size_t i = 0; i < size; ++i) {
+        const MemoryUpdate& update = updates[i];
+        bool ok = false;
+
+        switch (update.operation) {
+        case MemoryOperation::REGISTER:
+            ok = Register(update.begin, update.end, update.status);
+            break;
+        case MemoryOperation::RELEASE:
+            ok = SetStatus(update.begin, update.end, MemoryStatus::FREE);
+            break;
+        case MemoryOperation::RESERVE:
+            ok = SetStatus(update.begin, update.end, MemoryStatus::RESERVED);
+            break;
+        }
+
+        if (!ok) {
+            return false;
+        }
+    }
     return true;
 }
 
@@ -145,44 +673,91 @@ bool MemoryMap::Release(uintptr_t begin, uintptr_t end) {
     return SetStatus(begin, end, MemoryStatus::FREE);
 }
 
-bool MemoryMap::FindIn(
-        uintptr_t begin, uintptr_t end,
-        size_t size, size_t alignment, MemoryStatus status,
-        uintptr_t* ret) {
-    MemoryRange range;
-    range.begin = begin;
-    range.end = end;
-    range.status = status;
-    
-    auto less = [](const MemoryRange& l, const MemoryRange& r) -> bool {
-        return l.end <= r.begin;
-    };
-
-    MemoryRange *from = std::lower_bound(
-        ranges_.Begin(), ranges_.End(), range, less);
-    MemoryRange *to = std::upper_bound(
-        ranges_.Begin(), ranges_.End(), range, less);
+// Walks the free ranges that can fit the allocation in the placement order
+// and returns true once the search is complete. Subtrees without free ranges
+// large enough are skipped entirely, so unless the alignment or the bounds
+// get in the way the first fit visits only one path down the tree.
+bool MemoryMap::Find(uint32_t node, Search* search) const {
+    const Node& n = nodes_[node];
+    const bool reverse = search->placement == Placement::TOP_DOWN;
+
+    for (uint32_t k = 0; k < n.count; ++k) {
+        const uint32_t i = reverse ? n.count - 1 - k : k;
+
+        if (!n.leaf) {
+            // All the ranges of a child end before the next child begins.
+            const uintptr_t from = n.i.keys[i];
+            const uintptr_t to = i + 1 < n.count
+                ? n.i.keys[i + 1] : ~static_cast<uintptr_t>(0);
+
+            if (from >= search->end || to <= search->begin) {
+                continue;
+            }
+            if (n.i.max_free[i] < search->size) {
+                continue;
+            }
+            if (Find(n.i.children[i], search)) {
+                return true;
+            }
+            continue;
+        }
 
-    for (MemoryRange *it = from; it != to; ++it) {
-        MemoryRange r = *it;
+        const MemoryRange& range = n.l.ranges[i];
+        if (range.status != MemoryStatus::FREE) {
+            continue;
+        }
 
-        if (r.status != status) {
+        uintptr_t addr;
+        if (!Place(range,
+                search->begin, search->end,
+                search->size, search->alignment, search->placement,
+                &addr)) {
             continue;
         }
 
-        r.begin = common::Clamp(r.begin, begin, end);
-        r.end = common::Clamp(r.end, begin, end);
+        const uintptr_t length = std::min(range.end, search->end)
+            - std::max(range.begin, search->begin);
+        if (search->found && length >= search->length) {
+            continue;
+        }
 
-        const uintptr_t addr = common::AlignUp(
-            r.begin, static_cast<uintptr_t>(alignment));
-        if (addr + size <= r.end) {
-            *ret = addr;
+        search->found = true;
+        search->addr = addr;
+        search->length = length;
+        if (search->fit == Fit::FIRST || length == search->size) {
             return true;
         }
     }
     return false;
 }
 
+bool MemoryMap::Find(
+        uintptr_t begin, uintptr_t end,
+        size_t size, size_t alignment,
+        Placement placement, Fit fit,
+        uintptr_t* ret) const {
+    if (root_ == kNone) {
+        return false;
+    }
+
+    Search search;
+    search.begin = begin;
+    search.end = end;
+    search.size = size;
+    search.alignment = alignment;
+    search.placement = placement;
+    search.fit = fit;
+    search.found = false;
+
+    Find(root_, &search);
+    if (!search.found) {
+        return false;
+    }
+
+    *ret = search.addr;
+    return true;
+}
+
 bool MemoryMap::AllocateIn(
         uintptr_t begin, uintptr_t end,
         size_t size, size_t alignment,
@@ -190,7 +765,9 @@ bool MemoryMap::AllocateIn(
 {
     uintptr_t addr;
 
-    if (!FindIn(begin, end, size, alignment, MemoryStatus::FREE, &addr)) {
+    if (!Find(
+            begin, end, size, alignment,
+            Placement::BOTTOM_UP, Fit::FIRST, &addr)) {
         return false;
     }
 
@@ -206,4 +783,43 @@ bool MemoryMap::Allocate(size_t size, size_t alignment, uintptr_t* ret) {
     return AllocateIn(0, ~static_cast<uintptr_t>(0), size, alignment, ret);
 }
 
+
+bool MemoryBatch::Add(const MemoryUpdate& update) {
+    return updates_.PushBack(update);
+}
+
+bool MemoryBatch::Register(
+        uintptr_t begin, uintptr_t end, MemoryStatus status) {
+    MemoryUpdate update;
+    update.operation = MemoryOperation::REGISTER;
+    update.status = status;
+    update.begin = begin;
+    update.end = end;
+    return Add(update);
+}
+
+bool MemoryBatch::Reserve(uintptr_t begin, uintptr_t end) {
+    MemoryUpdate update;
+    update.operation = MemoryOperation::RESERVE;
+    update.status = MemoryStatus::RESERVED;
+    update.begin = begin;
+    update.end = end;
+    return Add(update);
+}
+
+bool MemoryBatch::Release(uintptr_t begin, uintptr_t end) {
+    MemoryUpdate update;
+    update.operation = MemoryOperation::RELEASE;
+    update.status = MemoryStatus::FREE;
+    update.begin = begin;
+    update.end = end;
+    return Add(update);
+}
+
+bool MemoryBatch::Flush() {
+    const bool ok = map_->ApplyBatch(updates_.Data(), updates_.Size());
+    updates_.Clear();
+    return ok;
+}
+
 }  // namespace memory
@@ -20,14 +20,133 @@ struct MemoryRange {
     MemoryStatus status;
 };
 
+// Which end of a free range an allocation is taken from, and, for first
+// fit, which end of the address range the search starts from.
+enum class Placement {
+    BOTTOM_UP,
+    TOP_DOWN,
+};
+
+// The first fit takes the first suitable free range in the placement order,
+// the best fit takes the smallest one.
+enum class Fit {
+    FIRST,
+    BEST,
+};
+
+enum class MemoryOperation {
+    REGISTER,
+    RELEASE,
+    RESERVE,
+};
+
+struct MemoryUpdate {
+    MemoryOperation operation;
+    // Only used by REGISTER.
+    MemoryStatus status;
+    uintptr_t begin;
+    uintptr_t end;
+};
+
+// Ranges are kept in a B+ tree ordered by address. Inner nodes remember the
+// first address and the size of the largest free range for every child, so
+// that lookups and allocations only visit a few nodes. Leaves are linked
+// together for iteration.
+//
+// Nodes come from the storage embedded in the map until it runs out, after
+// that the map grows using the physical memory allocator, so it can only grow
+// past the embedded storage once the allocator is up.
 class MemoryMap {
+private:
+    static constexpr uint32_t kNone = ~static_cast<uint32_t>(0);
+    static constexpr uint32_t kLeafRanges = 16;
+    static constexpr uint32_t kFanout = 16;
+    static constexpr uint32_t kEmbeddedNodes = 32;
+
+    struct Leaf {
+        uint32_t prev;
+        uint32_t next;
+        MemoryRange ranges[kLeafRanges];
+    };
+
+    struct Inner {
+        uintptr_t keys[kFanout];
+        uintptr_t max_free[kFanout];
+        uint32_t children[kFanout];
+    };
+
+    struct Node {
+        uint32_t parent;
+        uint32_t count;
+        bool leaf;
+        union {
+            Leaf l;
+            Inner i;
+        };
+    };
+
+    struct Position {
+        uint32_t leaf;
+        uint32_t index;
+    };
+
+    struct Search {
+        uintptr_t begin;
+        uintptr_t end;
+        size_t size;
+        size_t alignment;
+        Placement placement;
+        Fit fit;
+        bool found;
+        uintptr_t addr;
+        uintptr_t length;
+    };
+
 public:
-    MemoryMap() {}
+    class ConstIterator {
+    public:
+        ConstIterator() : map_(nullptr), pos_{kNone, 0} {}
+
+        const MemoryRange& operator*() const { return map_->At(pos_); }
+        const MemoryRange* operator->() const { return &map_->At(pos_); }
+
+        ConstIterator& operator++() {
+            pos_ = map_->Next(pos_);
+            return *this;
+        }
+
+        ConstIterator operator++(int) {
+            ConstIterator it = *this;
+            ++*this;
+            return it;
+        }
+
+        bool operator==(const ConstIterator& other) const {
+            return pos_.leaf == other.pos_.leaf
+                && pos_.index == other.pos_.index;
+        }
+
+        bool operator!=(const ConstIterator& other) const {
+            return !(*this == other);
+        }
+
+    private:
+        friend class MemoryMap;
+
+        ConstIterator(const MemoryMap* map, Position pos)
+            : map_(map), pos_(pos) {}
 
-    MemoryMap(const MemoryMap& other) = default;
-    MemoryMap(MemoryMap&& other) = default;
-    MemoryMap& operator=(const MemoryMap& other) = default;
-    MemoryMap& operator=(MemoryMap&& other) = default;
+        const MemoryMap* map_;
+        Position pos_;
+    };
+
+    MemoryMap();
+    ~MemoryMap();
+
+    MemoryMap(const MemoryMap& other) = delete;
+    MemoryMap(MemoryMap&& other) = delete;
+    MemoryMap& operator=(const MemoryMap& other) = delete;
+    MemoryMap& operator=(MemoryMap&& other) = delete;
 
     bool Register(uintptr_t begin, uintptr_t end, MemoryStatus status);
     bool Reserve(uintptr_t begin, uintptr_t end);
@@ -38,17 +157,100 @@ public:
         uintptr_t *ret);
     bool Allocate(size_t size, size_t alignment, uintptr_t* ret);
 
-    const MemoryRange* ConstBegin() const { return ranges_.ConstBegin(); }
-    const MemoryRange* ConstEnd() const { return ranges_.ConstEnd(); }
+    // Finds a free aligned block of the given size within [begin, end)
+    // without reserving it.
+    bool Find(
+        uintptr_t begin, uintptr_t end,
+        size_t size, size_t alignment,
+        Placement placement, Fit fit,
+        uintptr_t* ret) const;
+
+    // Applies all the updates at once. The updates are sorted by address and
+    // overlapping updates of the same kind are merged, so the order of the
+    // updates doesn't matter: all registrations are applied first, then all
+    // releases and then all reservations. The array is reordered in place.
+    // The batch is applied either entirely or not at all: a failure leaves
+    // the map unchanged.
+    bool ApplyBatch(MemoryUpdate* updates, size_t size);
+
+    size_t Size() const { return size_; }
+
+    ConstIterator ConstBegin() const {
+        return ConstIterator(this, Position{first_, 0});
+    }
+
+    ConstIterator ConstEnd() const {
+        return ConstIterator(this, Position{kNone, 0});
+    }
 
 private:
     bool SetStatus(uintptr_t begin, uintptr_t end, MemoryStatus status);
-    bool FindIn(
-        uintptr_t begin, uintptr_t end,
-        size_t size, size_t alignment, MemoryStatus status,
-        uintptr_t* ret);
+    bool CanRegister(
+        uintptr_t begin, uintptr_t end, MemoryStatus status) const;
+    bool Find(uint32_t node, Search* search) const;
+
+    bool EnsureCapacity(size_t nodes);
+    uint32_t InsertCost() const;
+    size_t Slack(uint32_t node) const;
+    size_t BatchCost(size_t updates) const;
+    uint32_t NewNode(bool leaf);
+    void FreeNode(uint32_t node);
+
+    MemoryRange& At(Position pos) {
+        return nodes_[pos.leaf].l.ranges[pos.index];
+    }
+    const MemoryRange& At(Position pos) const {
+        return nodes_[pos.leaf].l.ranges[pos.index];
+    }
+    Position Next(Position pos) const;
+    Position Prev(Position pos) const;
+    Position Lookup(uintptr_t addr) const;
+
+    Position Insert(Position pos, const MemoryRange& range);
+    Position Erase(Position pos);
+    void SplitAt(uintptr_t addr);
+    void Coalesce(uintptr_t begin, uintptr_t end);
+
+    uintptr_t FirstAddress(uint32_t node) const;
+    uintptr_t MaxFree(uint32_t node) const;
+    uint32_t ChildIndex(uint32_t parent, uint32_t child) const;
+    void Update(uint32_t node);
+    void InsertChild(uint32_t parent, uint32_t after, uint32_t child);
+    void RemoveChild(uint32_t parent, uint32_t child);
+
+    Node* nodes_;
+    uint32_t capacity_;
+    uint32_t used_;
+    uint32_t live_;
+    uint32_t free_;
+    uint32_t root_;
+    uint32_t first_;
+    uint32_t last_;
+    size_t size_;
+    Node embedded_[kEmbeddedNodes];
+};
+
+// Collects updates and applies all of them to the map at once on Flush, so
+// like with ApplyBatch their order doesn't matter. Batches are used before
+// the allocator is set up, so the buffer can't grow: once it's full, the
+// updates fail instead of splitting the batch in parts that would be
+// applied in order.
+class MemoryBatch {
+public:
+    explicit MemoryBatch(MemoryMap* map) : map_(map) {}
+
+    bool Register(uintptr_t begin, uintptr_t end, MemoryStatus status);
+    bool Reserve(uintptr_t begin, uintptr_t end);
+    bool Release(uintptr_t begin, uintptr_t end);
+    bool Flush();
+
+private:
+    bool Add(const MemoryUpdate& update);
+
+    static constexpr size_t kMaxUpdates = 64;
 
-    common::FixedVector<MemoryRange, 128> ranges_;
+    MemoryMap* map_;
+    common::FixedVector<MemoryUpdate, kMaxUpdates> updates_;
 };
 
 }  // namespace memory
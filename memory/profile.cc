@@ -0,0 +1,315 @@
+#include "profile.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include "arch.h"
+#include "common/logging.h"
+
+
+namespace memory {
+
+namespace impl {
+
+bool heap_profile_running = false;
+size_t heap_profile_samples = 0;
+
+}  // namespace impl
+
+namespace {
+
+constexpr size_t kMaxDepth = 8;
+constexpr size_t kSites = 256;
+constexpr size_t kSamples = 4096;
+constexpr uintptr_t kMaxFrameSize = 64 * 1024;
+
+struct Site {
+    uintptr_t frames[kMaxDepth];
+    size_t depth;
+    size_t samples;
+    size_t bytes;
+};
+
+struct Sample {
+    void* ptr;
+    size_t bytes;
+    Site* site;
+};
+
+// Both tables use open addressing with linear probing. Samples are removed
+// using tombstones, so that lookups don't stop early, and the tombstones are
+// reused by the following insertions.
+Site sites[kSites];
+Sample samples[kSamples];
+void* const kTombstone = reinterpret_cast<void*>(~static_cast<uintptr_t>(0));
+
+// Counts the live samples by the hash of the pointer, so that frees can tell
+// that a pointer wasn't sampled without taking the lock. The counters are
+// only changed under the lock, before the sampled pointer is returned to the
+// caller of memory::Allocate, so a zero counter is never stale for it.
+constexpr size_t kFilterSize = 4 * kSamples;
+uint16_t filter[kFilterSize];
+
+size_t period = 0;
+int64_t countdown = 0;
+size_t dropped = 0;
+bool lock = false;
+
+void Lock() {
+    while (__atomic_test_and_set(&lock, __ATOMIC_ACQUIRE)) {
+        Yield();
+    }
+}
+
+void Unlock() {
+    __atomic_clear(&lock, __ATOMIC_RELEASE);
+}
+
+size_t Hash(uintptr_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    return static_cast<size_t>(x);
+}
+
+size_t Hash(const uintptr_t* frames, size_t depth) {
+    size_t hash = depth;
+    for (size_t i = 0; i < depth; ++i) {
+        hash = Hash(hash ^ frames[i]);
+    }
+    return hash;
+}
+
+// AArch64 frame records consist of the frame pointer of the caller followed
+// by the return address. We don't know where the stack begins or ends, so
+// we stop when the frame record doesn't look sane: frames must be aligned
+// and move up the stack by a reasonable amount every time.
+size_t Backtrace(void* caller, void* frame, uintptr_t* frames) {
+    size_t depth = 0;
+    uintptr_t fp = reinterpret_cast<uintptr_t>(frame);
+
+    frames[depth++] = reinterpret_cast<uintptr_t>(caller);
+    while (depth < kMaxDepth && fp != 0 && fp % 16 == 0) {
+        const uintptr_t* record = reinterpret_cast<const uintptr_t*>(fp);
+        const uintptr_t next = record[0];
+
+        if (next <= fp || next - fp > kMaxFrameSize) {
+            break;
+        }
+
+        fp = next;
+        record = reinterpret_cast<const uintptr_t*>(fp);
+        if (record[1] == 0) {
+            break;
+        }
+        frames[depth++] = record[1];
+    }
+    return depth;
+}
+
+bool SameFrames(const uintptr_t* l, const uintptr_t* r, size_t depth) {
+    for (size_t i = 0; i < depth; ++i) {
+        if (l[i] != r[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+Site* FindSite(const uintptr_t* frames, size_t depth) {
+    const size_t hash = Hash(frames, depth);
+
+    for (size_t i = 0; i < kSites; ++i) {
+        Site* site = &sites[(hash + i) % kSites];
+
+        if (site->depth == 0) {
+            memcpy(site->frames, frames, depth * sizeof(frames[0]));
+            site->depth = depth;
+            return site;
+        }
+
+        if (site->depth == depth && SameFrames(site->frames, frames, depth)) {
+            return site;
+        }
+    }
+    return nullptr;
+}
+
+bool AddSample(void* ptr, size_t bytes, Site* site) {
+    const size_t hash = Hash(reinterpret_cast<uintptr_t>(ptr));
+
+    for (size_t i = 0; i < kSamples; ++i) {
+        Sample* sample = &samples[(hash + i) % kSamples];
+
+        if (sample->ptr == nullptr || sample->ptr == kTombstone) {
+            sample->ptr = ptr;
+            sample->bytes = bytes;
+            sample->site = site;
+            return true;
+        }
+    }
+    return false;
+}
+
+uint16_t* FilterSlot(void* ptr) {
+    return &filter[Hash(reinterpret_cast<uintptr_t>(ptr)) % kFilterSize];
+}
+
+bool MaybeSampled(void* ptr) {
+    return __atomic_load_n(FilterSlot(ptr), __ATOMIC_RELAXED) != 0;
+}
+
+Sample* FindSample(void* ptr) {
+    const size_t hash = Hash(reinterpret_cast<uintptr_t>(ptr));
+
+    for (size_t i = 0; i < kSamples; ++i) {
+        Sample* sample = &samples[(hash + i) % kSamples];
+
+        if (sample->ptr == ptr) {
+            return sample;
+        }
+        if (sample->ptr == nullptr) {
+            break;
+        }
+    }
+    return nullptr;
+}
+
+}  // namespace
+
+
+namespace impl {
+
+void SampleAllocation(void* ptr, size_t size, void* caller, void* frame) {
+    const int64_t left = __atomic_sub_fetch(
+        &countdown, static_cast<int64_t>(size), __ATOMIC_RELAXED);
+    if (left > 0) {
+        return;
+    }
+    __atomic_store_n(&countdown, static_cast<int64_t>(period), __ATOMIC_RELAXED);
+
+    uintptr_t frames[kMaxDepth];
+    const size_t depth = Backtrace(caller, frame, frames);
+
+    // Every sample stands for about period bytes allocated at the site, so
+    // that small allocations aren't underrepresented in the profile.
+    const size_t bytes = std::max(size, period);
+
+    Lock();
+    if (!heap_profile_running) {
+        Unlock();
+        return;
+    }
+
+    Site* site = FindSite(frames, depth);
+    if (site == nullptr || !AddSample(ptr, bytes, site)) {
+        ++dropped;
+    } else {
+        site->samples++;
+        site->bytes += bytes;
+        __atomic_add_fetch(FilterSlot(ptr), 1, __ATOMIC_RELAXED);
+        ++heap_profile_samples;
+    }
+    Unlock();
+}
+
+void SampleFree(void* ptr) {
+    if (!MaybeSampled(ptr)) {
+        return;
+    }
+
+    Lock();
+    Sample* sample = FindSample(ptr);
+    if (sample != nullptr) {
+        sample->site->samples--;
+        sample->site->bytes -= sample->bytes;
+        sample->ptr = kTombstone;
+        __atomic_sub_fetch(FilterSlot(ptr), 1, __ATOMIC_RELAXED);
+        --heap_profile_samples;
+    }
+    Unlock();
+}
+
+void SampleResize(void* ptr, size_t size) {
+    if (!MaybeSampled(ptr)) {
+        return;
+    }
+
+    Lock();
+    Sample* sample = FindSample(ptr);
+    if (sample != nullptr) {
+        const size_t bytes = std::max(size, period);
+        sample->site->bytes = sample->site->bytes - sample->bytes + bytes;
+        sample->bytes = bytes;
+    }
+    Unlock();
+}
+
+}  // namespace impl
+
+
+void StartHeapProfile(size_t sample_period) {
+    Lock();
+    memset(sites, 0, sizeof(sites));
+    memset(samples, 0, sizeof(samples));
+    memset(filter, 0, sizeof(filter));
+    period = std::max(sample_period, static_cast<size_t>(1));
+    countdown = static_cast<int64_t>(period);
+    dropped = 0;
+    impl::heap_profile_samples = 0;
+    impl::heap_profile_running = true;
+    Unlock();
+}
+
+void StopHeapProfile() {
+    Lock();
+    impl::heap_profile_running = false;
+    Unlock();
+}
+
+void DumpHeapProfile() {
+    Lock();
+    common::Log() << "Heap profile, one sample per " << period << " bytes, "
+          << impl::heap_profile_samples << " live samples, "
+          << dropped << " dropped:\n";
+
+    for (size_t i = 0; i < kSites; ++i) {
+        const Site& site = sites[i];
+
+        if (site.depth == 0 || site.samples == 0) {
+            continue;
+        }
+
+        common::Log() << site.bytes << " bytes in " << site.samples
+              << " samples at";
+        for (size_t j = 0; j < site.depth; ++j) {
+            common::Log() << " " << reinterpret_cast<const void*>(
+                site.frames[j]);
+        }
+        common::Log() << "\n";
+    }
+    Unlock();
+}
+
+size_t HeapProfileBytes(const void* from, const void* to) {
+    const uintptr_t begin = reinterpret_cast<uintptr_t>(from);
+    const uintptr_t end = reinterpret_cast<uintptr_t>(to);
+    size_t bytes = 0;
+
+    Lock();
+    for (size_t i = 0; i < kSites; ++i) {
+        const Site& site = sites[i];
+
+        if (site.depth == 0 || site.samples == 0) {
+            continue;
+        }
+        if (site.frames[0] >= begin && site.frames[0] < end) {
+            bytes += site.bytes;
+        }
+    }
+    Unlock();
+    return bytes;
+}
+
+}  // namespace memory
@@ -0,0 +1,44 @@
+#ifndef __MEMORY_PROFILE_H__
+#define __MEMORY_PROFILE_H__
+
+#include <cstddef>
+
+namespace memory {
+
+// Sampling heap profiler. While it's running roughly one allocation per
+// period bytes allocated with memory::Allocate is sampled together with a
+// short backtrace of the caller, and live sampled allocations are
+// aggregated per call site. The profile is kept when the profiler stops,
+// so that it can be dumped later, and restarting the profiler resets it.
+//
+// Call sites are found by following the frame pointers, so the backtraces
+// are only as good as the frame records the compiler left on the stack.
+void StartHeapProfile(size_t period);
+void StopHeapProfile();
+void DumpHeapProfile();
+
+// Returns the live bytes sampled at the call sites whose innermost frame,
+// i.e. the return address of memory::Allocate, is within [from, to). That
+// way the tests can check the profile of a particular function.
+size_t HeapProfileBytes(const void* from, const void* to);
+
+namespace impl {
+
+// The allocator checks these before calling into the profiler, so that
+// the cost of the profiler when it's not running is a load and a branch.
+extern bool heap_profile_running;
+extern size_t heap_profile_samples;
+
+// SampleFree and SampleResize only take the profiler lock for pointers that
+// might have been sampled, frees of other pointers stay lock-free even when
+// the profile has live samples. SampleResize updates the sampled size of an
+// allocation resized in place.
+void SampleAllocation(void* ptr, size_t size, void* caller, void* frame);
+void SampleFree(void* ptr);
+void SampleResize(void* ptr, size_t size);
+
+}  // namespace impl
+
+}  // namespace memory
+
+#endif  // __MEMORY_PROFILE_H__
@@ -1,5 +1,14 @@
 #include "space.h"
 
+#include <algorithm>
+#include <cstring>
+
+#include "arch.h"
+#include "cache.h"
+#include "memory.h"
+#include "tlb.h"
+#include "common/math.h"
+
 namespace memory {
 
 namespace impl {
@@ -13,17 +22,21 @@ uintptr_t PageTable::Address() const {
 }
 
 bool PageTable::IsClear(size_t entry) const {
-    return (descriptors_[entry] & kPresent) == 0;
+    return (descriptors_[entry] & kValid) == 0;
 }
 
 bool PageTable::IsTable(size_t entry) const {
-    const uint64_t mask = kPresent | kTable;
-    return (descriptors_[entry] & mask) == mask; 
+    const uint64_t mask = kValid | kTable;
+    return (descriptors_[entry] & mask) == mask;
+}
+
+bool PageTable::IsBlock(size_t entry) const {
+    const uint64_t mask = kValid | kTable;
+    return (descriptors_[entry] & mask) == kValid;
 }
 
-bool PageTable::IsMemory(size_t entry) const {
-    const uint64_t mask = kPresent | kTable;
-    return (descriptors_[entry] & mask) == kPresent;
+bool PageTable::IsContiguous(size_t entry) const {
+    return (descriptors_[entry] & kContiguous) != 0;
 }
 
 void PageTable::Clear(size_t entry) {
@@ -31,20 +44,27 @@ void PageTable::Clear(size_t entry) {
 }
 
 void PageTable::SetTable(size_t entry, const PageTable& table) {
-    descriptors_[entry] = table.Address() | kPresent | kTable;
+    descriptors_[entry] = table.Address() | kValid | kTable;
 }
 
-void PageTable::SetMemory(size_t entry, const Memory& memory) {
-    descriptors_[entry] = memory.addr | memory.attr | kPresent;
+void PageTable::SetPage(size_t entry, const Memory& memory, bool contiguous) {
+    descriptors_[entry] = memory.addr | memory.attr
+        | kValid | kPage | kPrivileged | kInnerShareable | kAccessFlag
+        | (contiguous ? kContiguous : 0);
+}
+
+void PageTable::SetBlock(
+        size_t entry, const Memory& memory, bool contiguous) {
+    descriptors_[entry] = memory.addr | memory.attr
+        | kValid | kPrivileged | kInnerShareable | kAccessFlag
+        | (contiguous ? kContiguous : 0);
 }
 
 Memory PageTable::GetMemory(size_t entry) const {
-    addr = descriptors_[entry] & kAddressMask;
-    attr = descriptors_[entry] & kAttributesMask;
-    return Memory{
-        .addr = addr,
-        .attr = attr,
-    };
+    Memory memory;
+    memory.addr = descriptors_[entry] & kAddressMask;
+    memory.attr = descriptors_[entry] & kMemoryAttributesMask;
+    return memory;
 }
 
 PageTable PageTable::GetTable(size_t entry) const {
@@ -53,7 +73,766 @@ PageTable PageTable::GetTable(size_t entry) const {
 
 }  // namespace impl
 
-bool SetupMapping() {
+
+namespace {
+
+// Translation tables have the same layout as the alloc-4096 objects, but
+// they aren't merged, so that DumpCaches shows the memory they take and
+// their slabs aren't shared with the general purpose allocations.
+Cache page_tables(
+    "page-tables", kPageSize, kPageSize, kCacheStatic | kCacheNoMerge);
+
+// With 4 KiB granule level 0 tables cannot contain blocks and the
+// contiguous hint is only used for pages and 2 MiB blocks.
+constexpr size_t kFirstBlockLevel = 1;
+constexpr size_t kFirstContiguousLevel = 2;
+constexpr size_t kContiguousEntries = impl::PageTable::kContiguousEntries;
+
+constexpr size_t EntryShift(size_t level) {
+    return kPageBits + 9 * (TranslationTable::kLevels - 1 - level);
+}
+
+constexpr uintptr_t EntrySize(size_t level) {
+    return static_cast<uintptr_t>(1) << EntryShift(level);
+}
+
+constexpr size_t EntryIndex(uintptr_t addr, size_t level) {
+    return (addr >> EntryShift(level)) & (impl::PageTable::kEntries - 1);
+}
+
+uintptr_t AllocateTable() {
+    void* ptr = page_tables.Allocate();
+    if (ptr == nullptr) {
+        return 0;
+    }
+    memset(ptr, 0, kPageSize);
+    return reinterpret_cast<uintptr_t>(ptr);
+}
+
+// Tables that are no longer reachable from the root might still be cached
+// by the TLBs, so they are only freed after the TLB invalidation. Until then
+// they are linked in a list through the first descriptor, table addresses
+// are page aligned, so the link looks like an invalid descriptor to the
+// table walker.
+void DeferFree(uintptr_t table, uintptr_t* garbage) {
+    *reinterpret_cast<uintptr_t*>(table) = *garbage;
+    *garbage = table;
+}
+
+void FreeTables(uintptr_t garbage) {
+    while (garbage != 0) {
+        const uintptr_t next = *reinterpret_cast<uintptr_t*>(garbage);
+        page_tables.Free(reinterpret_cast<void*>(garbage));
+        garbage = next;
+    }
+}
+
+bool Aligned(uintptr_t addr) {
+    return (addr & (kPageSize - 1)) == 0;
+}
+
+void SetLeaf(
+        impl::PageTable table, size_t level, size_t entry,
+        const impl::Memory& memory, bool contiguous) {
+    if (level == TranslationTable::kLevels - 1) {
+        table.SetPage(entry, memory, contiguous);
+    } else {
+        table.SetBlock(entry, memory, contiguous);
+    }
+}
+
+// Whether [addr, next) can be mapped by a single page or block descriptor
+// on the given level.
+bool IsLeaf(size_t level, uintptr_t addr, uintptr_t next, uintptr_t phys) {
+    if (level == TranslationTable::kLevels - 1) {
+        return true;
+    }
+
+    const uintptr_t size = EntrySize(level);
+    return level >= kFirstBlockLevel
+        && next - addr == size
+        && (addr & (size - 1)) == 0
+        && (phys & (size - 1)) == 0;
+}
+
+// Whether the group of descriptors starting at the entry can be populated
+// at once with the contiguous hint set.
+bool IsContiguous(
+        impl::PageTable table, size_t level, size_t entry,
+        uintptr_t addr, uintptr_t to, uintptr_t phys) {
+    const uintptr_t size = EntrySize(level) * kContiguousEntries;
+
+    if (level < kFirstContiguousLevel || entry % kContiguousEntries != 0) {
+        return false;
+    }
+    if (to - addr < size || (phys & (size - 1)) != 0) {
+        return false;
+    }
+    for (size_t i = 0; i < kContiguousEntries; ++i) {
+        if (!table.IsClear(entry + i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Changing the contiguous hint of live descriptors requires the
+// break-before-make sequence: the whole group is invalidated and flushed
+// from the TLB before the descriptors are written back without the hint.
+void Unfold(
+        impl::PageTable table, size_t level, size_t entry, uintptr_t addr,
+        TlbBatch* tlb) {
+    const uintptr_t size = EntrySize(level);
+    const size_t first = common::AlignDown(entry, kContiguousEntries);
+    impl::Memory memory[kContiguousEntries];
+    bool valid[kContiguousEntries];
+
+    for (size_t i = 0; i < kContiguousEntries; ++i) {
+        valid[i] = !table.IsClear(first + i);
+        if (valid[i]) {
+            memory[i] = table.GetMemory(first + i);
+        }
+        table.Clear(first + i);
+    }
+
+    tlb->Add(
+        common::AlignDown(addr, size * kContiguousEntries),
+        size * kContiguousEntries, size);
+    tlb->Flush();
+
+    for (size_t i = 0; i < kContiguousEntries; ++i) {
+        if (valid[i]) {
+            SetLeaf(table, level, first + i, memory[i], false);
+        }
+    }
+}
+
+// Replaces a block with a table of the next level that maps the same memory
+// using the break-before-make sequence as well.
+bool Split(
+        impl::PageTable table, size_t level, size_t entry, uintptr_t addr,
+        TlbBatch* tlb) {
+    const uintptr_t address = AllocateTable();
+    if (address == 0) {
+        return false;
+    }
+
+    const impl::Memory memory = table.GetMemory(entry);
+    const uintptr_t size = EntrySize(level);
+    const uintptr_t part_size = EntrySize(level + 1);
+    impl::PageTable child(address);
+
+    for (size_t i = 0; i < impl::PageTable::kEntries; ++i) {
+        const impl::Memory part{memory.addr + i * part_size, memory.attr};
+        SetLeaf(child, level + 1, i, part, true);
+    }
+
+    table.Clear(entry);
+    tlb->Add(common::AlignDown(addr, size), size, size);
+    tlb->Flush();
+    table.SetTable(entry, child);
+    return true;
+}
+
+}  // namespace
+
+
+TranslationTable::~TranslationTable() {
+    if (root_ == 0) {
+        return;
+    }
+
+    uintptr_t garbage = 0;
+    Free(impl::PageTable(root_), 0, &garbage);
+    FreeTables(garbage);
+}
+
+uintptr_t TranslationTable::Root() {
+    if (root_ == 0) {
+        root_ = AllocateTable();
+    }
+    return root_;
+}
+
+bool TranslationTable::Map(
+        uintptr_t virt, uintptr_t phys, size_t size, uint64_t attrs) {
+    if (!Aligned(virt) || !Aligned(phys) || !Aligned(size)) {
+        return false;
+    }
+    if (virt >= kMaxAddress || kMaxAddress - virt < size) {
+        return false;
+    }
+    if (size == 0) {
+        return true;
+    }
+
+    const uintptr_t root = Root();
+    if (root == 0) {
+        return false;
+    }
+
+    const bool ret = Map(
+        impl::PageTable(root), 0,
+        virt, virt + size, phys, attrs & kMemoryAttributesMask);
+
+    // Only invalid descriptors were replaced, and those are never cached
+    // in the TLB, so it's enough to make the new descriptors visible to the
+    // table walker.
+    DsbIshSt();
+    Isb();
+    return ret;
+}
+
+bool TranslationTable::Map(
+        impl::PageTable table, size_t level,
+        uintptr_t from, uintptr_t to, uintptr_t phys, uint64_t attrs) {
+    const uintptr_t size = EntrySize(level);
+
+    for (uintptr_t addr = from; addr < to;) {
+        const uintptr_t begin = common::AlignDown(addr, size);
+        const uintptr_t next = std::min(begin + size, to);
+        const size_t entry = EntryIndex(addr, level);
+        const uintptr_t target = phys + (addr - from);
+
+        if (level < kLevels - 1 && table.IsTable(entry)) {
+            if (!Map(table.GetTable(entry), level + 1,
+                     addr, next, target, attrs)) {
+                return false;
+            }
+            addr = next;
+            continue;
+        }
+
+        // Already mapped with a page or a block, that must map the same
+        // memory the same way.
+        if (!table.IsClear(entry)) {
+            const impl::Memory memory = table.GetMemory(entry);
+            if (memory.addr + (addr - begin) != target
+                    || memory.attr != attrs) {
+                return false;
+            }
+            addr = next;
+            continue;
+        }
+
+        if (IsLeaf(level, addr, next, target)) {
+            const size_t entries =
+                IsContiguous(table, level, entry, addr, to, target)
+                    ? kContiguousEntries : 1;
+
+            for (size_t i = 0; i < entries; ++i) {
+                const impl::Memory memory{target + i * size, attrs};
+                SetLeaf(table, level, entry + i, memory, entries > 1);
+            }
+            addr = begin + entries * size;
+            continue;
+        }
+
+        const uintptr_t child = AllocateTable();
+        if (child == 0) {
+            return false;
+        }
+        table.SetTable(entry, impl::PageTable(child));
+
+        if (!Map(table.GetTable(entry), level + 1, addr, next, target, attrs)) {
+            return false;
+        }
+        addr = next;
+    }
+    return true;
+}
+
+bool TranslationTable::Unmap(uintptr_t virt, size_t size) {
+    if (root_ == 0 || size == 0 || virt >= kMaxAddress) {
+        return true;
+    }
+
+    const uintptr_t from = common::AlignDown(virt, kPageSize);
+    const uintptr_t to = common::AlignUp(
+        std::min(kMaxAddress - virt, size) + virt, kPageSize);
+    uintptr_t garbage = 0;
+    TlbBatch tlb;
+
+    const bool ret = Unmap(
+        impl::PageTable(root_), 0, from, to, &garbage, &tlb);
+    tlb.Flush();
+    FreeTables(garbage);
+    return ret;
+}
+
+bool TranslationTable::Unmap(
+        impl::PageTable table, size_t level,
+        uintptr_t from, uintptr_t to, uintptr_t* garbage, TlbBatch* tlb) {
+    const uintptr_t size = EntrySize(level);
+
+    for (uintptr_t addr = from; addr < to;) {
+        const uintptr_t begin = common::AlignDown(addr, size);
+        const uintptr_t next = std::min(begin + size, to);
+        const size_t entry = EntryIndex(addr, level);
+        const bool whole = addr == begin && next == begin + size;
+
+        if (table.IsClear(entry)) {
+            addr = next;
+            continue;
+        }
+
+        if (level < kLevels - 1 && table.IsTable(entry)) {
+            if (whole) {
+                // Any of the pages under the table might be in the TLB.
+                Free(table.GetTable(entry), level + 1, garbage);
+                table.Clear(entry);
+                tlb->Add(begin, size, kPageSize);
+            } else if (!Unmap(
+                    table.GetTable(entry), level + 1,
+                    addr, next, garbage, tlb)) {
+                return false;
+            }
+            addr = next;
+            continue;
+        }
+
+        // The descriptors of a contiguous group that stay mapped must lose
+        // the hint.
+        if (table.IsContiguous(entry)) {
+            const uintptr_t group = size * kContiguousEntries;
+            const uintptr_t first = common::AlignDown(addr, group);
+
+            if (first < from || first + group > to) {
+                Unfold(table, level, entry, addr, tlb);
+            }
+        }
+
+        if (whole) {
+            table.Clear(entry);
+            tlb->Add(begin, size, size);
+        } else if (!Split(table, level, entry, addr, tlb) || !Unmap(
+                table.GetTable(entry), level + 1,
+                addr, next, garbage, tlb)) {
+            return false;
+        }
+        addr = next;
+    }
+    return true;
+}
+
+void TranslationTable::Free(
+        impl::PageTable table, size_t level, uintptr_t* garbage) {
+    if (level < kLevels - 1) {
+        for (size_t entry = 0; entry < impl::PageTable::kEntries; ++entry) {
+            if (table.IsTable(entry)) {
+                Free(table.GetTable(entry), level + 1, garbage);
+            }
+        }
+    }
+    DeferFree(table.Address(), garbage);
+}
+
+bool TranslationTable::Translate(uintptr_t virt, uintptr_t* phys) const {
+    if (root_ == 0 || virt >= kMaxAddress) {
+        return false;
+    }
+
+    impl::PageTable table(root_);
+    for (size_t level = 0; level < kLevels; ++level) {
+        const size_t entry = EntryIndex(virt, level);
+
+        if (table.IsClear(entry)) {
+            return false;
+        }
+        if (level < kLevels - 1 && table.IsTable(entry)) {
+            table = table.GetTable(entry);
+            continue;
+        }
+
+        *phys = table.GetMemory(entry).addr | (virt & (EntrySize(level) - 1));
+        return true;
+    }
+    return false;
+}
+
+
+bool AddressRange::Overlap(const AddressRange& other) const {
+    return from < other.to && other.from < to;
+}
+
+bool AddressRange::Touch(const AddressRange& other) const {
+    return from <= other.to && other.from <= to;
+}
+
+bool AddressRange::Before(const AddressRange& other) const {
+    return to <= other.from;
+}
+
+bool AddressRange::After(const AddressRange& other) const {
+    return from >= other.to;
+}
+
+
+Mapping::Mapping(const AddressRange& range, uint64_t attrs)
+    : range_(range), attrs_(attrs)
+{}
+
+AddressRange Mapping::Range() const {
+    return range_;
+}
+
+uint64_t Mapping::Attributes() const {
+    return attrs_;
+}
+
+void Mapping::Unmap(uintptr_t from, uintptr_t to, TranslationTable* table) {
+    table->Unmap(from, to - from);
+}
+
+bool Mapping::Fault(uintptr_t addr, bool write, TranslationTable* table) {
+    if (write && (Attributes() & kReadOnly) != 0) {
+        return false;
+    }
+    const uintptr_t page = common::AlignDown(addr, kPageSize);
+    return Map(page, page + kPageSize, table);
+}
+
+
+StaticMapping::StaticMapping(
+        const AddressRange& virt, uintptr_t phys, uint64_t attrs)
+    : Mapping(virt, attrs), phys_(phys)
+{}
+
+bool StaticMapping::Map(
+        uintptr_t from, uintptr_t to, TranslationTable* table) {
+    const AddressRange range = Range();
+    const uintptr_t phys = phys_ + (from - range.from);
+    return table->Map(from, phys, to - from, Attributes());
+}
+
+
+namespace {
+
+// Shared by all the anonymous mappings, it's part of the kernel image, which
+// is identity mapped, so its address is its physical address.
+alignas(kPageSize) const uint8_t zero_page[kPageSize] = {};
+
+uintptr_t ZeroPage() {
+    return reinterpret_cast<uintptr_t>(zero_page);
+}
+
+// Anonymous mappings collect the pages they free in chunks, so that the TLB
+// is invalidated once per chunk before the pages are returned.
+constexpr size_t kFreeChunkPages = 64;
+
+}  // namespace
+
+AnonymousMapping::AnonymousMapping(const AddressRange& range, uint64_t attrs)
+    : Mapping(range, attrs)
+{}
+
+bool AnonymousMapping::Map(
+        uintptr_t from, uintptr_t to, TranslationTable* table) {
+    for (uintptr_t addr = from; addr < to; addr += kPageSize) {
+        if (!MapPage(addr, table)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void AnonymousMapping::Unmap(
+        uintptr_t from, uintptr_t to, TranslationTable* table) {
+    uintptr_t pages[kFreeChunkPages];
+
+    while (from < to) {
+        const uintptr_t end = std::min(from + kFreeChunkPages * kPageSize, to);
+        size_t count = 0;
+
+        for (uintptr_t addr = from; addr < end; addr += kPageSize) {
+            uintptr_t phys;
+            if (table->Translate(addr, &phys) && phys != ZeroPage()) {
+                pages[count++] = phys;
+            }
+        }
+
+        // Pages come and go one at a time, so there are no blocks to split
+        // and Unmap can't fail.
+        table->Unmap(from, end - from);
+        for (size_t i = 0; i < count; ++i) {
+            FreePhysical(pages[i]);
+        }
+        from = end;
+    }
+}
+
+bool AnonymousMapping::Fault(
+        uintptr_t addr, bool write, TranslationTable* table) {
+    const uintptr_t page = common::AlignDown(addr, kPageSize);
+
+    if (write) {
+        if ((Attributes() & kReadOnly) != 0) {
+            return false;
+        }
+        return MapPage(page, table);
+    }
+
+    // Another CPU might have resolved the fault in the meantime.
+    uintptr_t phys;
+    if (table->Translate(page, &phys)) {
+        return true;
+    }
+    return table->Map(page, ZeroPage(), kPageSize, Attributes() | kReadOnly);
+}
+
+bool AnonymousMapping::MapPage(uintptr_t addr, TranslationTable* table) {
+    uintptr_t phys;
+    if (table->Translate(addr, &phys)) {
+        if (phys != ZeroPage()) {
+            return true;
+        }
+        // Break before make: the zero page has to be unmapped and the TLB
+        // invalidated before the private page is mapped instead.
+        if (!table->Unmap(addr, kPageSize)) {
+            return false;
+        }
+    }
+
+    std::optional<Contigous> mem = AllocatePhysical(kPageSize);
+    if (!mem) {
+        return false;
+    }
+
+    const uintptr_t from = mem->FromAddress();
+    memset(reinterpret_cast<void*>(from), 0, kPageSize);
+    if (!table->Map(addr, from, kPageSize, Attributes())) {
+        FreePhysical(*mem);
+        return false;
+    }
+    return true;
+}
+
+
+AddressSpace::~AddressSpace() {
+    while (Mapping* mapping = mappings_.PopFront()) {
+        const AddressRange range = mapping->Range();
+        mapping->Unmap(range.from, range.to, &table_);
+        delete mapping;
+    }
+}
+
+uintptr_t AddressSpace::PageTable() {
+    return table_.Root();
+}
+
+bool AddressSpace::RegisterMapping(std::unique_ptr<Mapping> mapping) {
+    const AddressRange range = mapping->Range();
+
+    if (range.from >= range.to || range.to > TranslationTable::kMaxAddress) {
+        return false;
+    }
+    if (!Aligned(range.from) || !Aligned(range.to)) {
+        return false;
+    }
+
+    Lock();
+    const bool ok = Link(mapping.get());
+    Unlock();
+
+    if (ok) {
+        mapping.release();
+    }
+    return ok;
+}
+
+Mapping* AddressSpace::FindMapping(uintptr_t addr) {
+    Lock();
+    Mapping* mapping = Lookup(addr);
+    Unlock();
+    return mapping;
+}
+
+std::unique_ptr<Mapping> AddressSpace::UnregisterMapping(Mapping* mapping) {
+    const AddressRange range = mapping->Range();
+
+    Lock();
+    mapping->Unmap(range.from, range.to, &table_);
+    mappings_.Unlink(mapping);
+    Unlock();
+    return std::unique_ptr<Mapping>(mapping);
+}
+
+bool AddressSpace::Translate(uintptr_t virt, uintptr_t* phys) const {
+    Lock();
+    const bool ok = table_.Translate(virt, phys);
+    Unlock();
+    return ok;
+}
+
+bool AddressSpace::Populate(uintptr_t from, uintptr_t to) {
+    Lock();
+    const bool ok = MapRange(from, to);
+    Unlock();
+    return ok;
+}
+
+bool AddressSpace::Fault(uintptr_t addr, bool write) {
+    Lock();
+    Mapping* mapping = Lookup(addr);
+    const bool ok = mapping != nullptr && mapping->Fault(addr, write, &table_);
+    Unlock();
+    return ok;
+}
+
+void AddressSpace::Lock() const {
+    while (__atomic_test_and_set(&lock_, __ATOMIC_ACQUIRE)) {
+        Yield();
+    }
+}
+
+void AddressSpace::Unlock() const {
+    __atomic_clear(&lock_, __ATOMIC_RELEASE);
+}
+
+bool AddressSpace::Link(Mapping* mapping) {
+    const AddressRange range = mapping->Range();
+
+    auto it = mappings_.Begin();
+    for (; it != mappings_.End(); ++it) {
+        const AddressRange other = it->Range();
+        if (range.Overlap(other)) {
+            return false;
+        }
+        if (range.Before(other)) {
+            break;
+        }
+    }
+    mappings_.LinkAt(it, mapping);
+    return true;
+}
+
+Mapping* AddressSpace::Lookup(uintptr_t addr) {
+    for (auto it = mappings_.Begin(); it != mappings_.End(); ++it) {
+        const AddressRange range = it->Range();
+        if (addr < range.from) {
+            break;
+        }
+        if (addr < range.to) {
+            return &*it;
+        }
+    }
+    return nullptr;
+}
+
+bool AddressSpace::MapRange(uintptr_t from, uintptr_t to) {
+    uintptr_t addr = common::AlignDown(from, kPageSize);
+    to = common::AlignUp(to, kPageSize);
+
+    for (auto it = mappings_.Begin(); it != mappings_.End(); ++it) {
+        if (addr >= to) {
+            break;
+        }
+
+        const AddressRange range = it->Range();
+        if (range.to <= addr) {
+            continue;
+        }
+        if (range.from > addr) {
+            return false;
+        }
+
+        const uintptr_t end = std::min(range.to, to);
+        if (!it->Map(addr, end, &table_)) {
+            return false;
+        }
+        addr = end;
+    }
+    return addr >= to;
+}
+
+
+namespace {
+
+AddressSpace* kernel_aspace = nullptr;
+
+bool MapLinear(uintptr_t from, uintptr_t to, AddressSpace* aspace) {
+    const AddressRange range{from, to};
+
+    if (!aspace->RegisterMapping(std::make_unique<StaticMapping>(
+            range, from, kNormalMemory))) {
+        return false;
+    }
+    return aspace->Populate(from, to);
+}
+
+// With the MMU off all data accesses are non-cacheable, so the caches might
+// only contain the lines left from the firmware that ran before us, and
+// those are older than the data in memory. They have to be discarded before
+// the caches are enabled, otherwise they would shadow the memory.
+void InvalidateDataCache() {
+    // ID_AA64MMFR2_EL1.CCIDX tells the format of CCSIDR_EL1.
+    const bool ccidx = ((GetIdAa64Mmfr2El1() >> 20) & 0xf) != 0;
+    const uint64_t clidr = GetClidrEl1();
+    const uint64_t levels = (clidr >> 24) & 0x7;
+
+    for (uint64_t level = 0; level < levels; ++level) {
+        const uint64_t type = (clidr >> (3 * level)) & 0x7;
+        // 0 means no cache, 1 means instruction cache only.
+        if (type < 2) {
+            continue;
+        }
+
+        SetCsselrEl1(level << 1);
+        Isb();
+        const uint64_t ccsidr = GetCcsidrEl1();
+        const uint64_t line_shift = (ccsidr & 0x7) + 4;
+        const uint64_t ways = ccidx
+            ? ((ccsidr >> 3) & 0x1fffff) + 1
+            : ((ccsidr >> 3) & 0x3ff) + 1;
+        const uint64_t sets = ccidx
+            ? ((ccsidr >> 32) & 0xffffff) + 1
+            : ((ccsidr >> 13) & 0x7fff) + 1;
+        const uint64_t way_shift =
+            ways > 1 ? __builtin_clz(static_cast<uint32_t>(ways - 1)) : 0;
+
+        for (uint64_t way = 0; way < ways; ++way) {
+            for (uint64_t set = 0; set < sets; ++set) {
+                DcIsw((way << way_shift) | (set << line_shift) | (level << 1));
+            }
+        }
+    }
+    DsbIsh();
+}
+
+}  // namespace
+
+bool SetupAddressSpace(const MemoryMap& mmap, AddressSpace* aspace) {
+    uintptr_t from = 0;
+    uintptr_t to = 0;
+
+    // Adjacent ranges are mapped together, so the boundaries between them
+    // don't have to be page aligned.
+    for (auto it = mmap.ConstBegin(); it != mmap.ConstEnd(); ++it) {
+        const uintptr_t begin = std::max(
+            common::AlignDown(it->begin, kPageSize), to);
+        const uintptr_t end = common::AlignUp(it->end, kPageSize);
+
+        if (begin >= end) {
+            continue;
+        }
+        if (begin == to) {
+            to = end;
+            continue;
+        }
+        if (from != to && !MapLinear(from, to, aspace)) {
+            return false;
+        }
+        from = begin;
+        to = end;
+    }
+
+    if (from != to) {
+        return MapLinear(from, to, aspace);
+    }
+    return true;
+}
+
+bool SetupMapping(AddressSpace* aspace) {
     // AArch64 System Register Descriptions, D13.2 General system control
     // registers, D13.2.85 MAIR_EL2, Memory Attribute Indirection Register (EL2)
     // for the encoding of the MAIR_EL2.
@@ -65,14 +844,75 @@ bool SetupMapping() {
     constexpr uint64_t kInnerReadAllocate = 0x2;
     constexpr uint64_t kInnerWriteAllocate = 0x1;
 
-    constexpr uint64_t mair =
+    constexpr uint64_t kNormal =
         kNormalOuterWriteBackNonTransient |
         kOuterReadAllocate | kOuterWriteAllocate |
         kNormalInnerWriteBackNonTransient |
         kInnerReadAllocate | kInnerWriteAllocate;
 
+    // Device-nGnRE: no gathering, no reordering, early write acknowledgement.
+    constexpr uint64_t kDevice = 0x04;
+
+    // Normal memory, outer and inner non-cacheable.
+    constexpr uint64_t kNonCacheable = 0x44;
+
+    // The indices must match kNormalMemory, kDeviceMemory and
+    // kNonCacheableMemory in space.h.
+    constexpr uint64_t mair = kNormal | (kDevice << 8) | (kNonCacheable << 16);
+
+    // D13.2.131 TCR_EL2, Translation Control Register (EL2), the format
+    // without the Virtualization Host Extensions. The table walks use the
+    // same write-back cacheable inner shareable memory as the rest of the
+    // kernel.
+    constexpr uint64_t kTcrRes1 = (1ull << 31) | (1ull << 23);
+    constexpr uint64_t kTcrT0sz = 64 - 48;
+    constexpr uint64_t kTcrIrgn0WriteBack = 1ull << 8;
+    constexpr uint64_t kTcrOrgn0WriteBack = 1ull << 10;
+    constexpr uint64_t kTcrSh0InnerShareable = 3ull << 12;
+    constexpr uint64_t kTcrTg04K = 0ull << 14;
+    constexpr uint64_t kTcrPsShift = 16;
+    // The largest physical address size the 48 bit output address of the
+    // descriptors can use.
+    constexpr uint64_t kPa48Bits = 0x5;
+
+    constexpr uint64_t kSctlrM = 1ull << 0;
+    constexpr uint64_t kSctlrC = 1ull << 2;
+    constexpr uint64_t kSctlrI = 1ull << 12;
+
+    const uint64_t mmfr0 = GetIdAa64Mmfr0El1();
+    // ID_AA64MMFR0_EL1.TGran4 is 0xf when 4 KiB granule isn't supported.
+    if (((mmfr0 >> 28) & 0xf) == 0xf) {
+        return false;
+    }
+    const uint64_t pa = std::min(mmfr0 & 0xf, kPa48Bits);
+
+    const uintptr_t root = aspace->PageTable();
+    if (root == 0) {
+        return false;
+    }
+
     SetMairEl2(mair);
+    SetTcrEl2(
+        kTcrRes1 | kTcrT0sz |
+        kTcrIrgn0WriteBack | kTcrOrgn0WriteBack | kTcrSh0InnerShareable |
+        kTcrTg04K | (pa << kTcrPsShift));
+    SetTtbar0El2(root);
+    Isb();
+
+    InvalidateDataCache();
+    TlbiAllE2Is();
+    IcIallu();
+    DsbIsh();
+    Isb();
+
+    SetSctlrEl2(GetSctlrEl2() | kSctlrM | kSctlrC | kSctlrI);
+    Isb();
+    kernel_aspace = aspace;
     return true;
 }
 
+AddressSpace* KernelAddressSpace() {
+    return kernel_aspace;
+}
+
 }  // namespace memory
@@ -3,10 +3,31 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <memory>
+
+#include "common/intrusive_list.h"
+#include "phys.h"
 
 
 namespace memory {
 
+class TlbBatch;
+
+// Attributes of the mapped memory, these are the bits of the stage 1 block
+// and page descriptors as is. The memory type is an index in the MAIR_EL2
+// register, so the types need to match the MAIR_EL2 configuration done in
+// SetupMapping below.
+constexpr uint64_t kNormalMemory = 0ull << 2;
+constexpr uint64_t kDeviceMemory = 1ull << 2;
+constexpr uint64_t kNonCacheableMemory = 2ull << 2;
+constexpr uint64_t kMemoryTypeMask = 7ull << 2;
+
+constexpr uint64_t kReadOnly = 1ull << 7;
+constexpr uint64_t kExecuteNever = 1ull << 54;
+
+constexpr uint64_t kMemoryAttributesMask =
+    kMemoryTypeMask | kReadOnly | kExecuteNever;
+
 namespace impl {
 
 struct Memory {
@@ -14,68 +35,126 @@ struct Memory {
     uint64_t attr;
 };
 
+// A wrapper around a single page worth of translation table descriptors.
+// Whether a valid descriptor describes a table or memory depends on the
+// level of the table as well: on the last level the descriptor that looks
+// like a table descriptor is a page descriptor.
+//
+// The contiguous hint tells the CPU that a naturally aligned group of
+// kContiguousEntries descriptors maps contiguous memory with the same
+// attributes, so it can cache the whole group in a single TLB entry.
 class PageTable {
 public:
-    static constexpr size_t kPageTableSize = 512;
-    static constexpr uint64_t kPresent = 1ull << 0;
+    static constexpr size_t kEntries = 512;
+    static constexpr size_t kContiguousEntries = 16;
+    static constexpr uint64_t kValid = 1ull << 0;
     static constexpr uint64_t kTable = 1ull << 1;
+    static constexpr uint64_t kPage = 1ull << 1;
 
-    // These flags need to match MAIR_EL2 register configuration.
-    // I only have normal memory configured in MAIR_EL2 for now (write-back
-    // caching policy, non-transient allocation on reads and writes for both
-    // outer and inner domains).
-    static constexpr uint64_t kNormalMemory = 1ull << 2;
-    static constexpr uint64_t kMemoryAttributeMask = kNormalMemory;
-
+    // AP[1] is RES1 for the EL2 translation regime.
     static constexpr uint64_t kPrivileged = 1ull << 6;
-    static constexpr uint64_t kWritable = 1ull << 7;
-    static constexpr uint64_t kExecuteNever = 1ull << 54;
-    static constexpr uint64_t kAccessMask = kPrivileged | kWritable | kExecuteNever;
-
-    static constexpr uint64_t kAttributesMask = kAccessMask | kMemoryAttributeMask;
-    static constexpr uint64_t ((1ull << 48) - 1) & ~((1ull << 12) - 1);
+    static constexpr uint64_t kInnerShareable = 3ull << 8;
+    static constexpr uint64_t kAccessFlag = 1ull << 10;
+    static constexpr uint64_t kContiguous = 1ull << 52;
+    static constexpr uint64_t kAddressMask =
+        ((1ull << 48) - 1) & ~((1ull << 12) - 1);
 
-    PageTable(uintptr_t address);
-
-    PageTable(const PageTable& other) = delete;
-    PageTable& operator=(const PageTable& other) = delete;
-
-    PageTable(PageTable&& other) = default;
-    PageTable& operator=(PageTable&& other) = default;
+    explicit PageTable(uintptr_t address);
 
     uintptr_t Address() const;
 
     bool IsClear(size_t entry) const;
     bool IsTable(size_t entry) const;
-    bool IsMemory(size_t entry) const;
+    bool IsBlock(size_t entry) const;
+    bool IsContiguous(size_t entry) const;
 
     void Clear(size_t entry);
     void SetTable(size_t entry, const PageTable& table);
-    void SetMemory(size_t entry, const Memory& memory);
+    void SetPage(size_t entry, const Memory& memory, bool contiguous);
+    void SetBlock(size_t entry, const Memory& memory, bool contiguous);
 
     Memory GetMemory(size_t entry) const;
     PageTable GetTable(size_t entry) const;
 
 private:
-    uint64_t *descriptors_;
+    uint64_t* descriptors_;
 };
 
 }  // namespace impl
 
 
-struct MemoryRange {
+// Stage 1 translation tables for the EL2 translation regime with 4 KiB
+// granule and 48 bit virtual addresses, i. e. 4 levels of tables. All the
+// addresses and sizes must be page aligned.
+//
+// Map uses 1 GiB and 2 MiB blocks whenever both virtual and physical
+// addresses are suitably aligned and sets the contiguous hint for the groups
+// of pages and 2 MiB blocks that allow it.
+//
+// The tables are allocated from a dedicated cache on demand, the root table
+// is allocated on the first use. The tables are accessed using their
+// physical addresses, so the memory they come from must be identity mapped.
+class TranslationTable {
+public:
+    static constexpr size_t kLevels = 4;
+    static constexpr uintptr_t kMaxAddress = 1ull << 48;
+
+    TranslationTable() = default;
+    ~TranslationTable();
+
+    TranslationTable(const TranslationTable&) = delete;
+    TranslationTable& operator=(const TranslationTable&) = delete;
+    TranslationTable(TranslationTable&&) = delete;
+    TranslationTable& operator=(TranslationTable&&) = delete;
+
+    // Returns the physical address of the root table or 0 if the root
+    // table couldn't be allocated.
+    uintptr_t Root();
+
+    // Mapping a range that is already mapped the same way is not an error,
+    // but mapping it differently is. On failure the range might be left
+    // partially mapped.
+    bool Map(uintptr_t virt, uintptr_t phys, size_t size, uint64_t attrs);
+
+    // Unmapping a part of a block replaces the block with a table of the
+    // next level, that has to be allocated, so Unmap may fail and leave the
+    // range partially unmapped. The memory of the block isn't mapped for a
+    // moment while it's being replaced, so the code must not unmap parts of
+    // the block it runs from or uses the stack in.
+    bool Unmap(uintptr_t virt, size_t size);
+    bool Translate(uintptr_t virt, uintptr_t* phys) const;
+
+private:
+    bool Map(
+        impl::PageTable table, size_t level,
+        uintptr_t from, uintptr_t to, uintptr_t phys, uint64_t attrs);
+    bool Unmap(
+        impl::PageTable table, size_t level,
+        uintptr_t from, uintptr_t to, uintptr_t* garbage, TlbBatch* tlb);
+    void Free(impl::PageTable table, size_t level, uintptr_t* garbage);
+
+    uintptr_t root_ = 0;
+};
+
+
+struct AddressRange {
     uintptr_t from;
     uintptr_t to;
 
-    bool Overlap(const MemoryRange& other) const;
-    bool Touch(const MemoryRange& other) const;
-    bool Before(const MemoryRange& other) const;
-    bool After(const MemoryRange& other) const;
+    bool Overlap(const AddressRange& other) const;
+    bool Touch(const AddressRange& other) const;
+    bool Before(const AddressRange& other) const;
+    bool After(const AddressRange& other) const;
 };
 
-class Mapping {
+// Mapping describes how a range of the virtual address space is backed. It
+// doesn't have to populate the translation tables upfront: Map is called
+// for the parts of the range that should be populated and Fault is called
+// when an access to an address within the range faults, write tells whether
+// the access was a write.
+class Mapping : public common::ListNode<Mapping> {
 public:
-    Mapping(const MemoryRange& range, uint64_t attrs);
+    Mapping(const AddressRange& range, uint64_t attrs);
     virtual ~Mapping() {}
 
     Mapping(const Mapping&) = delete;
@@ -83,46 +162,101 @@ public:
     Mapping(Mapping&&) = delete;
     Mapping& operator=(Mapping&&) = delete;
 
-    MemoryRange AddressRange() const;
+    AddressRange Range() const;
     uint64_t Attributes() const;
 
-    virtual bool Map(uintptr_t from, uintptr_t to, PageTable* root) = 0;
-    virtual void Unmap(uintptr_t from, uintptr_t to, PageTable* root) = 0;
-    virtual bool Fault(uintptr_t addr, PageTable* root) = 0;
+    virtual bool Map(uintptr_t from, uintptr_t to, TranslationTable* table) = 0;
+    virtual void Unmap(uintptr_t from, uintptr_t to, TranslationTable* table);
+    virtual bool Fault(uintptr_t addr, bool write, TranslationTable* table);
 
 private:
-    MemoryRange range_;
+    AddressRange range_;
     uint64_t attrs_;
 };
 
+// Maps the virtual range to the physical range of the same size starting at
+// the given physical address.
 class StaticMapping : public Mapping {
 public:
-    MemoryMapping(const MemoryRange& virt, const MemoryRange& phys, uint64_t attrs);
+    StaticMapping(const AddressRange& virt, uintptr_t phys, uint64_t attrs);
+
+    bool Map(uintptr_t from, uintptr_t to, TranslationTable* table) override;
+
+private:
+    uintptr_t phys_;
+};
+
+// Zero filled memory allocated a page at a time on the first write. Reads of
+// the pages that weren't written yet map a single shared zero page read only,
+// so the following write faults again and replaces it with a private page.
+// Map populates the range with private pages and Unmap frees them.
+class AnonymousMapping : public Mapping {
+public:
+    AnonymousMapping(const AddressRange& range, uint64_t attrs);
 
-    bool Map(uintptr_t from, uintptr_t to, PageTable* root) override;
-    void Unmap(uintptr_t from, uintptr_t to, PageTable* root) override;
-    bool Fault(uintptr_t addr, PageTable* root) override;
+    bool Map(uintptr_t from, uintptr_t to, TranslationTable* table) override;
+    void Unmap(uintptr_t from, uintptr_t to, TranslationTable* table) override;
+    bool Fault(uintptr_t addr, bool write, TranslationTable* table) override;
 
 private:
-    MemoryRange phys_;
+    bool MapPage(uintptr_t addr, TranslationTable* table);
 };
 
+// The address space owns the translation tables and the mappings. Mappings
+// are kept sorted by address and don't overlap. All the operations take a
+// spinlock, so the mappings are called under it and faults of the same
+// address on different CPUs are resolved one after the other. The mapping
+// returned by FindMapping stays valid only until it's unregistered.
 class AddressSpace {
 public:
-    uintptr_t PageTable() const;
+    AddressSpace() = default;
+    ~AddressSpace();
 
-    bool RegisterMapping(std::unique_ptr<Mapping> mapping);
-    const Mapping* FindMapping(uintptr_t addr);
-    std::unique_ptr<Mapping> UnregisterMapping(const Mapping* mapping);
+    AddressSpace(const AddressSpace&) = delete;
+    AddressSpace& operator=(const AddressSpace&) = delete;
+    AddressSpace(AddressSpace&&) = delete;
+    AddressSpace& operator=(AddressSpace&&) = delete;
+
+    uintptr_t PageTable();
 
-    bool Translate(uintptr_t virt, uintptr_t* phys);
+    bool RegisterMapping(std::unique_ptr<Mapping> mapping);
+    Mapping* FindMapping(uintptr_t addr);
+    // Unmaps the whole range of the mapping and returns the ownership of
+    // the mapping to the caller.
+    std::unique_ptr<Mapping> UnregisterMapping(Mapping* mapping);
+
+    bool Translate(uintptr_t virt, uintptr_t* phys) const;
+    // Populates the translation tables for the given range, the range must
+    // be covered by the registered mappings.
     bool Populate(uintptr_t from, uintptr_t to);
-    bool Fault(uintptr_t addr); 
+    // Resolves a translation or permission fault at the given address using
+    // the mapping that covers it, returns false if the access isn't allowed.
+    bool Fault(uintptr_t addr, bool write);
 
 private:
+    void Lock() const;
+    void Unlock() const;
+
+    bool Link(Mapping* mapping);
+    Mapping* Lookup(uintptr_t addr);
+    bool MapRange(uintptr_t from, uintptr_t to);
+
+    TranslationTable table_;
+    common::IntrusiveList<Mapping> mappings_;
+    mutable bool lock_ = false;
 };
 
-bool SetupMapping();
+// Identity maps all the memory in the memory map, both free and reserved, as
+// Normal write-back memory.
+bool SetupAddressSpace(const MemoryMap& mmap, AddressSpace* aspace);
+
+// Configures the EL2 translation regime to use the translation tables of the
+// address space and enables the MMU and the caches. The code that calls it
+// must be identity mapped.
+bool SetupMapping(AddressSpace* aspace);
+
+// The address space installed by SetupMapping or nullptr before that.
+AddressSpace* KernelAddressSpace();
 
 }  // namespace memory
 
@@ -0,0 +1,153 @@
+#include "tlb.h"
+
+#include <algorithm>
+
+#include "arch.h"
+#include "memory.h"
+
+namespace memory {
+
+namespace {
+
+// D8.16 TLB maintenance instructions, the encoding of the range operand:
+// the range covers (NUM + 1) << (5 * SCALE + 1) pages starting at BaseADDR.
+constexpr uint64_t kRangeGranule4K = 1ull << 46;
+constexpr uint64_t kRangeScaleShift = 44;
+constexpr uint64_t kRangeNumShift = 39;
+constexpr uint64_t kRangeBaseMask = (1ull << 37) - 1;
+constexpr uint64_t kRangeScales = 4;
+constexpr uint64_t kRangeNumMask = 0x1f;
+// All the pages the range operations can cover with a single instruction
+// per scale.
+constexpr uint64_t kRangeMaxPages = 1ull << 21;
+
+constexpr uint64_t RangeShift(uint64_t scale) {
+    return 5 * scale + 1;
+}
+
+bool HasRangeInvalidation() {
+    // ID_AA64ISAR0_EL1.TLB is 0b0010 when both the outer shareable and the
+    // range TLB maintenance instructions are implemented.
+    return ((GetIdAa64Isar0El1() >> 56) & 0xf) >= 2;
+}
+
+size_t RangeOperations(uint64_t pages) {
+    if (pages >= kRangeMaxPages) {
+        return ~static_cast<size_t>(0);
+    }
+
+    size_t ops = pages % 2;
+    for (uint64_t scale = 0; scale < kRangeScales; ++scale) {
+        if (((pages >> RangeShift(scale)) & kRangeNumMask) != 0) {
+            ++ops;
+        }
+    }
+    return ops;
+}
+
+// The range operations only cover an even number of pages, so the odd page
+// is invalidated separately, and the rest is split into at most one
+// operation per scale starting from the smallest one.
+void InvalidateRange(uintptr_t addr, uint64_t pages) {
+    if (pages % 2 != 0) {
+        TlbiVae2Is(addr >> kPageBits);
+        addr += kPageSize;
+        --pages;
+    }
+
+    for (uint64_t scale = 0; scale < kRangeScales && pages != 0; ++scale) {
+        const uint64_t shift = RangeShift(scale);
+        const uint64_t num = (pages >> shift) & kRangeNumMask;
+
+        if (num == 0) {
+            continue;
+        }
+
+        TlbiRvae2Is(
+            kRangeGranule4K |
+            (scale << kRangeScaleShift) |
+            ((num - 1) << kRangeNumShift) |
+            ((addr >> kPageBits) & kRangeBaseMask));
+        addr += (num << shift) << kPageBits;
+        pages -= num << shift;
+    }
+}
+
+void InvalidateEach(uintptr_t from, uintptr_t to, size_t granule) {
+    for (uintptr_t addr = from; addr < to; addr += granule) {
+        TlbiVae2Is(addr >> kPageBits);
+    }
+}
+
+}  // namespace
+
+void TlbBatch::Add(uintptr_t addr, size_t size, size_t granule) {
+    if (all_ || size == 0) {
+        return;
+    }
+
+    // Invalidating with the smaller granule covers the larger descriptors
+    // too, so adjacent ranges can always be merged.
+    if (!ranges_.Empty() && ranges_.Back().to == addr) {
+        Range& last = ranges_.Back();
+        last.to = addr + size;
+        last.granule = std::min(last.granule, granule);
+        return;
+    }
+
+    if (!ranges_.PushBack(Range{addr, addr + size, granule})) {
+        AddAll();
+    }
+}
+
+void TlbBatch::AddAll() {
+    all_ = true;
+    ranges_.Clear();
+}
+
+size_t TlbBatch::Operations(bool ranged) const {
+    size_t ops = 0;
+
+    for (const Range* range = ranges_.ConstBegin();
+            range != ranges_.ConstEnd(); ++range) {
+        const size_t range_ops = ranged
+            ? RangeOperations((range->to - range->from) >> kPageBits)
+            : (range->to - range->from) / range->granule;
+
+        if (range_ops > kMaxOperations) {
+            return range_ops;
+        }
+        ops += range_ops;
+    }
+    return ops;
+}
+
+void TlbBatch::Flush() {
+    if (!all_ && ranges_.Empty()) {
+        return;
+    }
+
+    const bool ranged = HasRangeInvalidation();
+
+    DsbIshSt();
+    if (all_ || Operations(ranged) > kMaxOperations) {
+        TlbiAllE2Is();
+    } else {
+        for (const Range* range = ranges_.ConstBegin();
+                range != ranges_.ConstEnd(); ++range) {
+            if (ranged) {
+                InvalidateRange(
+                    range->from, (range->to - range->from) >> kPageBits);
+            } else {
+                InvalidateEach(range->from, range->to, range->granule);
+            }
+        }
+    }
+    DsbIsh();
+    Isb();
+
+    ranges_.Clear();
+    all_ = false;
+}
+
+}  // namespace memory
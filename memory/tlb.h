@@ -0,0 +1,57 @@
+#ifndef __MEMORY_TLB_H__
+#define __MEMORY_TLB_H__
+
+#include <cstddef>
+#include <cstdint>
+
+#include "common/fixed_vector.h"
+
+
+namespace memory {
+
+// Collects the TLB invalidations needed after changes to the translation
+// tables and issues them at once, so that a large change pays for the
+// barriers only once.
+//
+// Ranges are invalidated with the range TLBI instructions when the CPU
+// supports them (FEAT_TLBIRANGE) and one descriptor at a time otherwise.
+// When that would take too many instructions, or too many ranges were
+// collected, the whole TLB is invalidated instead.
+class TlbBatch {
+public:
+    TlbBatch() = default;
+
+    TlbBatch(const TlbBatch&) = delete;
+    TlbBatch& operator=(const TlbBatch&) = delete;
+    TlbBatch(TlbBatch&&) = delete;
+    TlbBatch& operator=(TlbBatch&&) = delete;
+
+    // The range [addr, addr + size) was mapped by descriptors covering
+    // granule bytes each, so without the range instructions it takes one
+    // invalidation per granule.
+    void Add(uintptr_t addr, size_t size, size_t granule);
+    void AddAll();
+
+    // Makes the translation table updates visible to the table walker and
+    // invalidates the collected ranges.
+    void Flush();
+
+private:
+    struct Range {
+        uintptr_t from;
+        uintptr_t to;
+        size_t granule;
+    };
+
+    static constexpr size_t kMaxRanges = 8;
+    static constexpr size_t kMaxOperations = 64;
+
+    size_t Operations(bool ranged) const;
+
+    common::FixedVector<Range, kMaxRanges> ranges_;
+    bool all_ = false;
+};
+
+}  // namespace memory
+
+#endif  // __MEMORY_TLB_H__
@@ -0,0 +1,191 @@
+#include "vmalloc.h"
+
+#include <memory>
+
+#include "memory.h"
+#include "phys.h"
+#include "space.h"
+#include "common/math.h"
+
+namespace memory {
+
+namespace {
+
+// The part of the kernel address space reserved for AllocateVirtual, it's
+// far above the identity mapped physical memory.
+constexpr uintptr_t kVirtualBegin = 1ull << 46;
+constexpr uintptr_t kVirtualEnd = 1ull << 47;
+
+// The largest block descriptors map 1 GiB, aligning the virtual addresses
+// any further doesn't allow using larger blocks.
+constexpr size_t kMaxAlignment = 1ull << 30;
+
+// Like anonymous mappings, the memory is freed in chunks, so that the TLB is
+// invalidated once per chunk before the memory is returned.
+constexpr size_t kFreeChunkBlocks = 64;
+
+// Maps the range to the memory allocated from the physical allocator. The
+// blocks are allocated largest first, starting from the largest block that
+// is aligned the same way as the virtual address, so both the physical and
+// the virtual address of every block are aligned to its size and the
+// translation tables can use block descriptors and contiguous hints for it.
+class VirtualMapping : public Mapping {
+public:
+    VirtualMapping(const AddressRange& range, uint64_t attrs);
+
+    bool Map(uintptr_t from, uintptr_t to, TranslationTable* table) override;
+    void Unmap(uintptr_t from, uintptr_t to, TranslationTable* table) override;
+    bool Fault(uintptr_t addr, bool write, TranslationTable* table) override;
+};
+
+VirtualMapping::VirtualMapping(const AddressRange& range, uint64_t attrs)
+    : Mapping(range, attrs)
+{}
+
+bool VirtualMapping::Map(
+        uintptr_t from, uintptr_t to, TranslationTable* table) {
+    size_t order = kMaxOrder;
+
+    while (from < to) {
+        uintptr_t phys;
+        if (table->Translate(from, &phys)) {
+            from += kPageSize;
+            continue;
+        }
+
+        while (order > 0
+                && (from % (kPageSize << order) != 0
+                    || to - from < (kPageSize << order))) {
+            --order;
+        }
+
+        std::optional<Contigous> mem = AllocatePhysical(kPageSize << order);
+        if (!mem) {
+            // Once a block of some size couldn't be allocated, there is no
+            // point trying the larger sizes again.
+            if (order == 0) {
+                return false;
+            }
+            --order;
+            continue;
+        }
+
+        if (!table->Map(from, mem->FromAddress(), mem->Size(), Attributes())) {
+            FreePhysical(*mem);
+            return false;
+        }
+        from += mem->Size();
+    }
+    return true;
+}
+
+// Only whole mappings are unmapped, so the blocks are never split between
+// the unmapped and the mapped parts of the range.
+void VirtualMapping::Unmap(
+        uintptr_t from, uintptr_t to, TranslationTable* table) {
+    uintptr_t blocks[kFreeChunkBlocks];
+
+    while (from < to) {
+        uintptr_t end = from;
+        size_t count = 0;
+
+        while (end < to && count < kFreeChunkBlocks) {
+            uintptr_t phys;
+            if (!table->Translate(end, &phys)) {
+                end += kPageSize;
+                continue;
+            }
+            blocks[count++] = phys;
+            end += kPageSize << AddressPage(phys)->order;
+        }
+
+        table->Unmap(from, end - from);
+        for (size_t i = 0; i < count; ++i) {
+            FreePhysical(blocks[i]);
+        }
+        from = end;
+    }
+}
+
+// The whole range is populated on allocation, so any fault is an access
+// outside of the allocated memory.
+bool VirtualMapping::Fault(uintptr_t, bool, TranslationTable*) {
+    return false;
+}
+
+MemoryMap virtual_space;
+bool virtual_space_ready = false;
+
+bool SetupVirtualSpace() {
+    if (!virtual_space_ready) {
+        virtual_space_ready = virtual_space.Register(
+            kVirtualBegin, kVirtualEnd, MemoryStatus::FREE);
+    }
+    return virtual_space_ready;
+}
+
+size_t Alignment(size_t size) {
+    size_t alignment = kPageSize;
+    while (alignment < kMaxAlignment && alignment * 2 <= size) {
+        alignment *= 2;
+    }
+    return alignment;
+}
+
+}  // namespace
+
+void* AllocateVirtual(size_t size) {
+    AddressSpace* aspace = KernelAddressSpace();
+    if (size == 0 || aspace == nullptr || !SetupVirtualSpace()) {
+        return nullptr;
+    }
+
+    size = common::AlignUp(size, kPageSize);
+    uintptr_t from;
+    if (!virtual_space.Allocate(size + kPageSize, Alignment(size), &from)) {
+        return nullptr;
+    }
+
+    const AddressRange range{from, from + size};
+    if (!aspace->RegisterMapping(std::make_unique<VirtualMapping>(
+            range, kNormalMemory | kExecuteNever))) {
+        virtual_space.Release(from, from + size + kPageSize);
+        return nullptr;
+    }
+
+    if (!aspace->Populate(range.from, range.to)) {
+        aspace->UnregisterMapping(aspace->FindMapping(from));
+        virtual_space.Release(from, from + size + kPageSize);
+        return nullptr;
+    }
+    return reinterpret_cast<void*>(from);
+}
+
+void FreeVirtual(void* ptr) {
+    const size_t size = VirtualSize(ptr);
+    if (size == 0) {
+        return;
+    }
+
+    const uintptr_t from = reinterpret_cast<uintptr_t>(ptr);
+    AddressSpace* aspace = KernelAddressSpace();
+    aspace->UnregisterMapping(aspace->FindMapping(from));
+    virtual_space.Release(from, from + size + kPageSize);
+}
+
+size_t VirtualSize(const void* ptr) {
+    const uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+    AddressSpace* aspace = KernelAddressSpace();
+    if (addr < kVirtualBegin || addr >= kVirtualEnd || aspace == nullptr) {
+        return 0;
+    }
+
+    // All the mappings in the reserved range are VirtualMappings.
+    const Mapping* mapping = aspace->FindMapping(addr);
+    if (mapping == nullptr || mapping->Range().from != addr) {
+        return 0;
+    }
+    return mapping->Range().to - mapping->Range().from;
+}
+
+}  // namespace memory
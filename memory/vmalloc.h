@@ -0,0 +1,27 @@
+#ifndef __MEMORY_VMALLOC_H__
+#define __MEMORY_VMALLOC_H__
+
+#include <cstddef>
+#include <cstdint>
+
+
+namespace memory {
+
+// Allocates virtually contiguous memory in the kernel address space, that
+// doesn't have to be physically contiguous, so large allocations succeed
+// even when the physical memory is fragmented. The memory is allocated from
+// the physical allocator in the largest naturally aligned blocks available,
+// so it's mapped with as few descriptors as the fragmentation allows.
+//
+// Every allocation is followed by an unmapped guard page. The kernel address
+// space must be installed with SetupMapping before the first allocation.
+void* AllocateVirtual(size_t size);
+void FreeVirtual(void* ptr);
+
+// Returns the size of the allocation, that is the requested size rounded up
+// to the page size, or 0 if ptr wasn't returned by AllocateVirtual.
+size_t VirtualSize(const void* ptr);
+
+}  // namespace memory
+
+#endif  // __MEMORY_VMALLOC_H__